@@ -29,7 +29,6 @@
 #define PERIOD 64 // Audio processing block size
 #define MIXLEN 64 // Mixing buffer length
 #define NCHANN 4 // Number of audio channels, for spatial processing
-#define NRANKS 32 // Maximum number of organ ranks (sets of pipes)
 
 /**
  * The Diffuser class implements diffusion filters for smoothing reverb effects
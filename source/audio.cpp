@@ -19,6 +19,7 @@
 
 
 #include <cmath>
+#include <ctime>
 #include <android/log.h>
 #include <unistd.h>
 #include "audio.h"
@@ -39,7 +40,17 @@ AeolusAudio::AeolusAudio (const char *name, Lfq_u32 *qnote, Lfq_u32 *qcomm) :
     _fsize (0),
     _bform (false),
     _nasect (0),
-    _ndivis (0)
+    _nused (0),
+    _ndivis (0),
+    _maxvoice (0),
+    _vlimit (0),
+    _nvoice (0),
+    _cpumax (0.0f),
+    _cpuload (0.0f),
+    _nsteal_rel (0),
+    _nsteal_snd (0),
+    _cull_db (-96.0f),
+    _cull (1.585e-5f)
 {
 }
 
@@ -79,6 +90,7 @@ void AeolusAudio::init_audio ()
     _reverb.set_t60hi (_revtime * 0.50f, 3e3f);
 
     _nasect = NASECT;
+    _nused = 0;
     for (i = 0; i < NASECT; i++)
     {
         _asectp [i] = new Asection ((float) _fsamp);
@@ -105,102 +117,22 @@ void AeolusAudio::start ()
 void AeolusAudio::proc_queue (Lfq_u32 *Q)
 {
     uint32_t  k;
-    int       b, c, i, j, n;
+    int       c, i, j, m, n;
     union     { uint32_t i; float f; } u;
 
     // Execute commands from the model thread (qcomm),
     // or from the midi thread (qnote).
 
-
-
     n = Q->read_avail ();
     while (n > 0)
     {
-
 	k = Q->read (0);
         c = k >> 24;      
         j = (k >> 16) & 255;
         i = (k >>  8) & 255; 
-        b = k & 255;
-
 
         switch (c)
 	{
-	case 0:
-	    // Single key off.
-            key_off (i, b);
-	    Q->read_commit (1);
-	    break;
-
-	case 1:
-	    // Single key on.
-            key_on (i, b);
-	    Q->read_commit (1);
-	    break;
-
-	case 2:
-	    // Conditional key off.
-	    cond_key_off (j, b);
-	    Q->read_commit (1);
-	    break;
-
-	case 3:
-	    // Conditional key on.
-	    cond_key_on (j, b);
-	    Q->read_commit (1);
-	    break;
-
-        case 4:
-	    // Clear bits in division mask.
-            _divisp [j]->clr_div_mask (b); 
-	    Q->read_commit (1);
-            break;
-
-        case 5:
-	    // Set bits in division mask.
-            __android_log_print(android_LogPriority::ANDROID_LOG_INFO,
-                                "AeolusAudio::proc_queue",
-                                "Setting division bits division %d, bits %d",j,b);
-            _divisp [j]->set_div_mask (b); 
-	    Q->read_commit (1);
-            break;
-
-        case 6:
-	    // Clear bits in rank mask.
-            _divisp [j]->clr_rank_mask (i, b); 
-	    Q->read_commit (1);
-            break;
-
-        case 7:
-	    // Set bits in rank mask.
-            __android_log_print(android_LogPriority::ANDROID_LOG_INFO,
-                                "AeolusAudio::proc_queue",
-                                "Activating rank %d in division %d for rank mask %d",i,j,b);
-            _divisp [j]->set_rank_mask (i, b);
-	    Q->read_commit (1);
-            break;
-
-        case 8:
-	    // Hold off.
-            _hold = KEYS_MASK;
-	    cond_key_off (HOLD_MASK, HOLD_MASK);
-	    Q->read_commit (1);
-	    break;
-
-        case 9:
-	    // Hold on.
-            _hold = KEYS_MASK | HOLD_MASK;
-	    cond_key_on (j, HOLD_MASK);
-	    Q->read_commit (1);
-	    break;
-
-        case 16:
-	    // Tremulant on/off.
-            if (b) _divisp [j]->trem_on (); 
-            else   _divisp [j]->trem_off ();
-	    Q->read_commit (1);
-            break;
-
         case 17:
 	    // Per-division performance controllers.
 	    if (n < 2) return;
@@ -215,14 +147,101 @@ void AeolusAudio::proc_queue (Lfq_u32 *Q)
              default: break;
 	    }
         break;
-        default:
+
+        case 18:
+            // A batch of commands, committed together by the model thread, see
+            // Model::set_ifelms. They are all applied in this period, and the
+            // divisions then update their keys once in proc_keys2 ().
+            m = k & 0xFFFFFF;
+            if (n < m + 1) return;
+            for (i = 1; i <= m; i++) proc_comm (Q->read (i));
+            Q->read_commit (m + 1);
             break;
+
+        default:
+            proc_comm (k);
+            Q->read_commit (1);
 	}
         n = Q->read_avail ();
     }
 }
 
 
+void AeolusAudio::proc_comm (uint32_t k)
+{
+    int  b, c, i, j;
+
+    c = k >> 24;      
+    j = (k >> 16) & 255;
+    i = (k >>  8) & 255; 
+    b = k & 255;
+
+    switch (c)
+    {
+    case 0:
+	// Single key off.
+        key_off (i, b);
+	break;
+
+    case 1:
+	// Single key on.
+        key_on (i, b);
+	break;
+
+    case 2:
+	// Conditional key off.
+	cond_key_off (j, b);
+	break;
+
+    case 3:
+	// Conditional key on.
+	cond_key_on (j, b);
+	break;
+
+    case 4:
+	// Clear bits in division mask.
+        _divisp [j]->clr_div_mask (b); 
+        break;
+
+    case 5:
+	// Set bits in division mask.
+        _divisp [j]->set_div_mask (b); 
+        break;
+
+    case 6:
+	// Clear bits in rank mask.
+        _divisp [j]->clr_rank_mask (i, b); 
+        break;
+
+    case 7:
+	// Set bits in rank mask.
+        _divisp [j]->set_rank_mask (i, b);
+        break;
+
+    case 8:
+	// Hold off.
+        _hold = KEYS_MASK;
+	cond_key_off (HOLD_MASK, HOLD_MASK);
+	break;
+
+    case 9:
+	// Hold on.
+        _hold = KEYS_MASK | HOLD_MASK;
+	cond_key_on (j, HOLD_MASK);
+	break;
+
+    case 16:
+	// Tremulant on/off.
+        if (b) _divisp [j]->trem_on (); 
+        else   _divisp [j]->trem_off ();
+        break;
+
+    default:
+        break;
+    }
+}
+
+
 void AeolusAudio::proc_keys1 ()
 {    
     int d, m, n;
@@ -253,13 +272,15 @@ void AeolusAudio::proc_keys2 ()
 
 void AeolusAudio::proc_synth (int nframes)
 {
-    int           j, k;
+    int           j, k, n;
     float         W [PERIOD];
     float         X [PERIOD];
     float         Y [PERIOD];
     float         Z [PERIOD];
     float         R [PERIOD];
     float        *out [8];
+    float         t;
+    timespec      t0, t1;
 
     if (fabsf (_revsize - _audiopar [REVSIZE]._val) > 0.001f)
     {
@@ -278,7 +299,9 @@ void AeolusAudio::proc_synth (int nframes)
     for (j = 0; j < _nplay; j++) out [j] = _outbuf [j];
     for (k = 0; k < nframes; k += PERIOD)
     {
+        clock_gettime (CLOCK_MONOTONIC, &t0);
         on_synth_period(k);
+        proc_voices ();
 
         memset (W, 0, PERIOD * sizeof (float));
         memset (X, 0, PERIOD * sizeof (float));
@@ -288,9 +311,9 @@ void AeolusAudio::proc_synth (int nframes)
 
 
         // Process the rankwaves in the division
-        for (j = 0; j < _ndivis; j++) _divisp [j]->process ();
+        for (j = 0; j < _ndivis; j++) _divisp [j]->process (_audiopar [VOLUME]._val, _cull);
         // Audio date is transmitted to the audiosection, and recovered through the pointers W,X,Y,R
-        for (j = 0; j < _nasect; j++) _asectp [j]->process (_audiopar [VOLUME]._val, W, X, Y, R);
+        for (j = 0; j < _nused; j++) _asectp [j]->process (_audiopar [VOLUME]._val, W, X, Y, R);
 
         _reverb.process (PERIOD, _audiopar [VOLUME]._val, R, W, X, Y, Z);
 
@@ -324,6 +347,65 @@ void AeolusAudio::proc_synth (int nframes)
 
         for (j = 0; j < _nplay; j++) out [j] += PERIOD;
 
+        // Measure the time used for this period against its real time duration. If it is
+        // above the target, reduce the voice limit in proportion, assuming the cost is mainly
+        // per voice. If it is well below, relax the limit by one voice per period.
+        clock_gettime (CLOCK_MONOTONIC, &t1);
+        t = ((t1.tv_sec - t0.tv_sec) + 1e-9f * (t1.tv_nsec - t0.tv_nsec)) * _fsamp / PERIOD;
+        _cpuload += 0.2f * (t - _cpuload);
+        if (_cpumax > 0.0f)
+        {
+            if (_cpuload > _cpumax)
+            {
+                n = (int)(_nvoice * _cpumax / _cpuload);
+                if (n < MINVOICE) n = MINVOICE;
+                if (! _vlimit || (n < _vlimit)) _vlimit = n;
+            }
+            else if (_vlimit && (_cpuload < 0.8f * _cpumax))
+            {
+                if (++_vlimit > 2 * _nvoice + MINVOICE) _vlimit = 0;
+            }
+        }
+    }
+}
+
+
+void AeolusAudio::proc_voices ()
+{
+    int    i, j, k, m, n;
+    float  g, gm;
+
+    n = 0;
+    for (j = 0; j < _ndivis; j++) n += _divisp [j]->nvoice ();
+    _nvoice = n;
+    k = _maxvoice;
+    if (_vlimit && (! k || (_vlimit < k))) k = _vlimit;
+    if (! k || (n <= k)) return;
+    n -= k;
+    // The quietest releasing voices first, whatever their division.
+    for (; n; n--)
+    {
+        k = -1;
+        gm = 0;
+        for (j = 0; j < _ndivis; j++)
+        {
+            if (((i = _divisp [j]->quietest (&g)) >= 0) && ((k < 0) || (g < gm)))
+            {
+                k = j;
+                m = i;
+                gm = g;
+            }
+        }
+        if (k < 0) break;
+        _divisp [k]->fade (m);
+        _nsteal_rel++;
+    }
+    // Then sounding voices, by rank.
+    for (j = _ndivis - 1; n && (j >= 0); j--)
+    {
+        m = _divisp [j]->steal (n);
+        _nsteal_snd += m;
+        n -= m;
     }
 }
 
@@ -347,7 +429,7 @@ void AeolusAudio::proc_mesg ()
 
 	        auto  *X = (M_new_divis *) M;
 
-                auto     *D = new Division (_asectp [X->_asect], (float) _fsamp);
+                auto     *D = new Division (_asectp [X->_asect], (float) _fsamp, _ndivis, X->_nrank);
 
                 D->set_div_mask (X->_dmask);
                 D->set_swell (X->_swell);
@@ -355,13 +437,24 @@ void AeolusAudio::proc_mesg ()
                 D->set_tmodd (X->_tmodd);
                 _divisp [_ndivis] = D;
                 _ndivis++;
+                if (_nused <= X->_asect) _nused = X->_asect + 1;
                 break; 
 	    }
 	    case MT_CALC_RANK:
 	    case MT_LOAD_RANK:
 	    {
 	        auto *X = (M_def_rank *) M;
-                _divisp [X->_divis]->set_rank (X->_rank, X->_wave,  X->_sdef->_pan, X->_sdef->_del);  
+                // The replaced rank goes back to the model thread for deletion.
+                X->_dead = _divisp [X->_divis]->set_rank (X->_rank, X->_wave,  X->_sdef->_pan, X->_sdef->_del);
+                send_event (TO_MODEL, M);
+
+	        break;
+	    }
+	    case MT_TUNE_RANK:
+	    {
+	        auto *X = (M_tune_rank *) M;
+                // Only sets the rates, the message goes back to the model thread for deletion.
+                X->_wave->retune (X->_ratio);
                 send_event (TO_MODEL, M);
 
 	        break;
@@ -404,6 +497,14 @@ void AeolusAudio::setMidiMapBit(int my_division_index, int my_midi_channel_index
     {
         return;
     }
+    if(my_division_index > 7)
+    {
+        // Only the lower byte of the midimap entry is the keyboard mapping.
+        __android_log_print(android_LogPriority::ANDROID_LOG_WARN,
+                            "AeolusSynthesizer::setMidiMapBit",
+                            "Division %d can't be mapped, only the first 8 can", my_division_index);
+        return;
+    }
 
     __android_log_print(android_LogPriority::ANDROID_LOG_INFO,
                         "AeolusSynthesizer::setMidiMapBit",
@@ -426,6 +527,40 @@ uint16_t AeolusAudio::get_midi_map_entry(int midi_index) {
     return _midimap[midi_index] & 0x000F;
 }
 
+void AeolusAudio::setMaxVoices(int max_voices)
+{
+    if (max_voices < 0) max_voices = 0;
+    _maxvoice = max_voices;
+}
+
+void AeolusAudio::setCpuTarget(float cpu_target)
+{
+    if (cpu_target < 0.0f) cpu_target = 0.0f;
+    if (cpu_target > 1.0f) cpu_target = 1.0f;
+    _cpumax = cpu_target;
+    _vlimit = 0;
+}
+
+void AeolusAudio::setCullLevel(float level_db)
+{
+    _cull_db = level_db;
+    _cull = (level_db < -200.0f) ? 0.0f : powf (10.0f, 0.05f * level_db);
+}
+
+uint32_t AeolusAudio::getCulledPeriods() const
+{
+    uint32_t n = 0;
+    for (int j = 0; j < _ndivis; j++) n += _divisp [j]->nskip ();
+    return n;
+}
+
+uint32_t AeolusAudio::getCulledReleases() const
+{
+    uint32_t n = 0;
+    for (int j = 0; j < _ndivis; j++) n += _divisp [j]->nkill ();
+    return n;
+}
+
 bool AeolusAudio::tremulantIsOn(int division_index)
 {
     if((division_index<0 )| (division_index>(_ndivis-1)))
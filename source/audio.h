@@ -30,6 +30,9 @@
 #include "global.h"
 #include "../../clthreads/include/clthreads.h"
 
+
+#define MINVOICE 16 // Lower bound of the voice limit derived from the CPU time target
+
 /**
  * Base class for the audio processing part of the Aeolus synthesizer. This class holds and orchestrates
  * the divisions (holding the ranks), the audio sections (for spatialization) as well as the reverb processor and
@@ -112,7 +115,8 @@ public:
 
     /**
      * Set a midi map bit
-     * @param my_division_index The division to be activated/deactived
+     * @param my_division_index The division to be activated/deactived, 0 to 7 as its bit is in the lower
+     *                          byte of the midimap entry, further divisions are rejected with a warning
      * @param my_midi_channel_index The midi-channel for which the division is to be activated / deactived
      *                              It seems that this should be 0-7 and not larger.
      * @param is_checked true for activation, false for inactivation
@@ -144,6 +148,75 @@ public:
 
     [[nodiscard]] bool tremulantIsOn(int division_index);
 
+    /**
+     * Set the voice budget, i.e. the maximum number of simultaneously sounding or releasing pipes
+     * over all divisions. When the budget is exceeded, voices are stolen, see proc_voices.
+     * @param max_voices Maximum number of voices, 0 for no limit
+     */
+    void setMaxVoices(int max_voices);
+    /**
+     * Get the voice budget
+     * @return Maximum number of voices, 0 for no limit
+     */
+    [[nodiscard]] int getMaxVoices() const { return _maxvoice; }
+    /**
+     * Set the CPU time target. When the time spent in proc_synth exceeds the given fraction of
+     * the real time duration of the audio, the number of voices is reduced accordingly.
+     * @param cpu_target Fraction of the available time, e.g. 0.7, or 0 to disable
+     */
+    void setCpuTarget(float cpu_target);
+    /**
+     * Get the CPU time target
+     * @return Fraction of the available time, 0 if disabled
+     */
+    [[nodiscard]] float getCpuTarget() const { return _cpumax; }
+    /**
+     * Get the measured CPU load of the synthesis
+     * @return Smoothed fraction of the real time duration spent in proc_synth
+     */
+    [[nodiscard]] float getCpuLoad() const { return _cpuload; }
+    /**
+     * Get the number of voices
+     * @return Number of sounding or releasing pipes at the start of the last period
+     */
+    [[nodiscard]] int getVoiceCount() const { return _nvoice; }
+    /**
+     * Voice stealing counter for releasing pipes
+     * @return Number of releasing pipes that were faded out early since the last reset
+     */
+    [[nodiscard]] uint32_t getStolenReleasing() const { return _nsteal_rel; }
+    /**
+     * Voice stealing counter for sounding pipes
+     * @return Number of pipes that were still on and had to be faded out since the last reset
+     */
+    [[nodiscard]] uint32_t getStolenSounding() const { return _nsteal_snd; }
+    /**
+     * Reset the voice stealing counters
+     */
+    void resetStealCounters() { _nsteal_rel = _nsteal_snd = 0; }
+    /**
+     * Set the audibility threshold. Pipes whose estimated output level (pipe level, release gain,
+     * division volume and swell, global volume) is below it are not rendered, and their release
+     * is ended early.
+     * @param level_db Threshold in dB relative to full scale, e.g. -96, or below -200 to render all pipes
+     */
+    void setCullLevel(float level_db);
+    /**
+     * Get the audibility threshold
+     * @return Threshold in dB relative to full scale
+     */
+    [[nodiscard]] float getCullLevel() const { return _cull_db; }
+    /**
+     * Culling statistics
+     * @return Number of pipe periods that were not rendered because they were inaudible
+     */
+    [[nodiscard]] uint32_t getCulledPeriods() const;
+    /**
+     * Culling statistics
+     * @return Number of release tails that were ended early because they were inaudible
+     */
+    [[nodiscard]] uint32_t getCulledReleases() const;
+
 
 protected:
 
@@ -158,6 +231,11 @@ protected:
      * the associated mask (terminal byte) reflects the impacted keyboards
      */
     void proc_queue (Lfq_u32 *);
+    /**
+     * Execute a single word command from a queue, see proc_queue
+     * @param k The command: type in the upper byte, then division, rank or note, and mask
+     */
+    void proc_comm (uint32_t k);
 
     /**
      * Process synthesizers. nframes is the number of frames to be filled. A frame in audio buffer terminology
@@ -183,6 +261,15 @@ protected:
      * Process messages from other threads (clthreads framework)
      */
     void proc_mesg ();
+    /**
+     * Enforce the voice budget, invoked for each period before the divisions are processed.
+     * The budget is the smaller of _maxvoice and, if a CPU time target is set, the limit _vlimit
+     * derived from the measured load. Excess voices are stolen, first the quietest releasing pipes
+     * over all divisions, then sounding pipes of the ranks with the highest index, starting with the
+     * last division.
+     * Stolen voices are faded out linearly over one period, so there are no clicks.
+     */
+    void proc_voices ();
 
     /**
      * Hook for a possible additional function. This is invoked for every synth period (there are several of them
@@ -318,6 +405,11 @@ protected:
      * Number of audio sections actually in use
      */
     int             _nasect;
+    /**
+     * Number of audio sections used by the divisions, the ones processed. The others only
+     * take memory.
+     */
+    int             _nused;
     /**
      * Number of divisions actually in use. Depends on the definition file
      */
@@ -349,6 +441,15 @@ protected:
     Fparm           _audiopar [4];
     float           _revsize;
     float           _revtime;
+    int             _maxvoice; // voice budget, 0 for no limit
+    int             _vlimit; // voice limit derived from the CPU time target, 0 for no limit
+    int             _nvoice; // voices in the last period
+    float           _cpumax; // CPU time target as a fraction of the period, 0 if disabled
+    float           _cpuload; // measured CPU time fraction, smoothed
+    uint32_t        _nsteal_rel; // stolen releasing pipes
+    uint32_t        _nsteal_snd; // stolen sounding pipes
+    float           _cull_db; // audibility threshold in dB
+    float           _cull; // audibility threshold, linear
 
 
 
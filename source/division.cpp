@@ -20,13 +20,18 @@
 
 #include <cmath>
 #include <cstring>
-#include <android/log.h>
 #include "division.h"
 
 
-Division::Division (Asection *asect, float fsam) :
+Division::Division (Asection *asect, float fsam, int index, int nrank) :
     _asect (asect),
+    _ranks (new Rankwave * [nrank]),
+    _voices (nrank * NNOTES, index),
+    _mrank (nrank),
     _nrank (0),
+    _active (new int [nrank]),
+    _nactive (0),
+    _dirty (false),
     _dmask (0),
     _trem (0),
     _fsam (fsam),
@@ -37,16 +42,18 @@ Division::Division (Asection *asect, float fsam) :
     _s (0.0f),
     _m (0.0f)
 {
-    for (int i = 0; i < NRANKS; i++) _ranks [i] = 0;
+    for (int i = 0; i < nrank; i++) _ranks [i] = nullptr;
 }
 
 
 Division::~Division ()
 {
+    delete[] _ranks;
+    delete[] _active;
 }
 
 
-void Division::process ()
+void Division::process (float vol, float thr)
 {
     int    i;
     float  d, g, t;
@@ -54,7 +61,8 @@ void Division::process ()
 
     memset (_buff, 0, NCHANN * PERIOD * sizeof (float));
 
-    for (i = 0; i < _nrank; i++) _ranks [i]->play (1);
+    // The gain below can rise by at most 5% in this period.
+    _voices.play (1.05f * _gain * _paramgain * vol, thr);
 
     g = _swel;
     if (_trem)
@@ -97,7 +105,7 @@ void Division::process ()
 }
 
 
-void Division::set_rank (int ind, Rankwave *W, int pan, int del)
+Rankwave *Division::set_rank (int ind, Rankwave *W, int pan, int del)
 {
     Rankwave *C;
 
@@ -105,36 +113,31 @@ void Division::set_rank (int ind, Rankwave *W, int pan, int del)
     if (C)
     {
         W->_nmask = C->_cmask;
-        delete C;
+        C->detach ();
     }
     else W->_nmask = 0;
     W->_cmask = 0;
     _ranks [ind] = W;
     del = (int)(1e-3f *(float) del * _fsam / PERIOD);
     if (del > 31) del = 31;
-    W->set_param (_buff, del, pan);
+    W->set_param (&_voices, ind, _buff, del, pan);
     if (_nrank < ++ind) _nrank = ind;
+    // The new rank takes over the mask of the old one.
+    _dirty = true;
+    return C;
 }
 
 
 void Division::update (int note, int mask)
 {
-    int             r;
+    int             i;
     Rankwave       *W;
 
-    for (r = 0; r < _nrank; r++)
+    for (i = 0; i < _nactive; i++)
     {
-	W = _ranks [r];
-
-        __android_log_print(android_LogPriority::ANDROID_LOG_INFO,
-                            "Division::update",
-                                            "1: c-mask %d n-mask %d ",W->_cmask, W->_nmask);
-
-        if (W->_cmask & 127)
-	{     
-	    if (mask & W->_cmask) W->note_on (note + 36);
-	    else                  W->note_off (note + 36);
-	}
+	W = _ranks [_active [i]];
+	if (mask & W->_cmask) W->note_on (note + 36);
+	else                  W->note_off (note + 36);
     }
 }
 
@@ -145,18 +148,17 @@ void Division::update (unsigned char *keys)
     unsigned char  *k;
     Rankwave       *W;
 
-    // run through the ranks for this division
+    if (! _dirty) return;
+    _dirty = false;
+    _nactive = 0;
+    // run through the ranks for this division, which may arrive in any order
     for (r = 0; r < _nrank; r++)
     {
 	W = _ranks [r]; // get the rank
+        if (! W) continue;
         // check with xor (^) whether there is a difference in the lower byte between the rank's c and n mask
         if ((W->_cmask ^ W->_nmask) & 127)
 	{
-
-        __android_log_print(android_LogPriority::ANDROID_LOG_INFO,
-                            "Division::update",
-                            "2: c-mask %d n-mask %d ",W->_cmask, W->_nmask);
-
             // m is the 7 lowest bits of the ranks n-mask
             m = W->_nmask & 127;               
             if (m) // the rank as a non-zero n-mask
@@ -175,6 +177,7 @@ void Division::update (unsigned char *keys)
             else W->all_off (); // for simplicity, if there is no bit set in the ranks mask, switch it off completely
 	}
         W->_cmask = W->_nmask; // update the mask: the c-mask is set equal to the n-mask
+        if (W->_cmask & 127) _active [_nactive++] = r;
     }
 }
 
@@ -189,8 +192,9 @@ void Division::set_div_mask (int bits)
     for (r = 0; r < _nrank; r++)
     {
 	W = _ranks [r];
-        if (W->_nmask & 128) W->_nmask |= bits;
+        if (W && (W->_nmask & 128)) W->_nmask |= bits;
     } 
+    _dirty = true;
 }
 
 
@@ -204,8 +208,9 @@ void Division::clr_div_mask (int bits)
     for (r = 0; r < _nrank; r++)
     {
 	W = _ranks [r];
-        if (W->_nmask & 128) W->_nmask &= ~bits;
+        if (W && (W->_nmask & 128)) W->_nmask &= ~bits;
     } 
+    _dirty = true;
 }
 
 
@@ -215,6 +220,7 @@ void Division::set_rank_mask (int ind, int bits)
 
     if (bits == 128) bits |= _dmask;
     W->_nmask |= bits;
+    _dirty = true;
 }
 
 
@@ -224,6 +230,7 @@ void Division::clr_rank_mask (int ind, int bits)
 
     if (bits == 128) bits |= _dmask;
     W->_nmask &= ~bits;
+    _dirty = true;
 }
 
 void Division::setParamGain(float division_volume_gain) {
@@ -38,19 +38,23 @@ public:
      * Constructor for a division
      * @param asect Pointer to audio section associated with this division
      * @param fsam Sampling frequency
+     * @param index Index of the division, selects its random number stream for the pipe instability
+     * @param nrank Number of ranks, their indices are 0 to nrank - 1
      */
-    Division (Asection *asect, float fsam);
+    Division (Asection *asect, float fsam, int index, int nrank);
     ~Division ();
 
     /**
      * Set the ind-th rankwave, if already set, replace ind-th rankwave
      * The rankwave is configured to use the common output buffer _buff
-     * @param ind ind-th rank wave
+     * @param ind ind-th rank wave, less than the number of ranks given to the constructor
      * @param W Rankwave (organ voice, register)
      * @param pan Audio panning (left, right or center)
      * @param del Time delta for sampling
+     * @return The replaced rankwave, or nullptr. It is detached from the division, but deleting it
+     *         is left to the caller as it is not a real time safe operation.
      */
-    void set_rank (int ind, Rankwave *W, int pan, int del);
+    Rankwave *set_rank (int ind, Rankwave *W, int pan, int del);
     /**
      *
      * @param stat
@@ -110,8 +114,10 @@ public:
  * Process the rankwave for this division
  * The output is directly transmitted to the audio section associated with this division via
  * internal pointer exchange
+ * @param vol Global volume applied after the division, used for the audibility of the pipes
+ * @param thr Audibility threshold below which pipes are not rendered, 0 to render all, see Voicetab::play
  */
-    void process ();
+    void process (float vol, float thr);
     /**
      * Update whether the ranks are playing a given note. For this,
      * the note and a binary mask is provided. The note is given as the delta from midi note 36
@@ -121,7 +127,7 @@ public:
      * is played if it is being played on at least one of the keyboards to which the rank responds. This function does
      * not change their rank masks, this task is performed first by the set_rank_mask and clr_rank_mask methods,
      * which change the ranks' _nmask field, and then by the update(unsigned char *keys) function that checks
-     * for discrepancy between _nmask and _cmask field
+     * for discrepancy between _nmask and _cmask field. Only the ranks that respond to a keyboard are visited.
      * @param note Midi note (above 36)
      * @param mask Mask for activation, with bits indicating keyboards (and as simplified implementation, divisions)
      */
@@ -131,18 +137,67 @@ public:
  * activation or deactivation of ranks. Activation state change that has occurred recently (between the last audio
  * and this audio cycle, that is) will not be correctly reflected in the note activation. It is recognized by a
  * discrepancy between the incoming rank mask (_nmask, for new mask) and the currently applied mask (_cmask, for current mask)
- * If such a discrepancy exists, readjust the notes playing or not by going through the entire key mapping passed as parameter
+ * If such a discrepancy exists, readjust the notes playing or not by going through the entire key mapping passed as parameter.
+ * Returns at once if no mask has been changed since the last call.
  * @param keys Keyboard activation map, from midi note 36 on, each entry indiciating bit-wise the keyboards currently playing the note
  */
     void update (unsigned char *keys);
 
+    /**
+     * Number of voices (sounding or releasing pipes) in this division that count against the
+     * voice budget, see AeolusAudio::proc_voices
+     * @return Number of voices not already fading out
+     */
+    [[nodiscard]] int nvoice () const { return _voices.nactive (); }
+    /**
+     * Voice stealing, find the quietest releasing voice of this division, see Voicetab::quietest
+     * @param g Output, its release gain
+     * @return Index of the voice, or -1 if there is none
+     */
+    int quietest (float *g) const { return _voices.quietest (g); }
+    /**
+     * Voice stealing, fade out a voice found by quietest () within the next period
+     * @param i Index of the voice
+     */
+    void fade (int i) { _voices.fade (i); }
+    /**
+     * Voice stealing, fade out up to n voices of this division within the next period, sounding
+     * pipes as well (ranks with the highest index first)
+     * @param n Number of voices to fade out
+     * @return Number of voices actually stolen
+     */
+    int steal (int n) { return _voices.steal (n); }
+    /**
+     * Culling statistics, see Voicetab::nskip
+     * @return Number of pipe periods not rendered because they were inaudible
+     */
+    [[nodiscard]] uint32_t nskip () const { return _voices.nskip (); }
+    /**
+     * Culling statistics, see Voicetab::nkill
+     * @return Number of release tails ended early because they were inaudible
+     */
+    [[nodiscard]] uint32_t nkill () const { return _voices.nkill (); }
+
 private:
    /** The audio section associated with this division */
     Asection  *_asect;
-    /** The array of ranks in this division, dimensioned for a maximum of NRANKS */
-    Rankwave  *_ranks [NRANKS];
-    /** The actual number of ranks in this division */
+    Division (const Division&);
+    Division& operator=(const Division&);
+
+    /** The array of ranks in this division, _mrank of them, null until a rank is set */
+    Rankwave **_ranks;
+    /** The pipes of all ranks that are sounding or releasing, played in a single pass by process () */
+    Voicetab   _voices;
+    /** The number of ranks allocated */
+    int        _mrank;
+    /** The actual number of ranks in this division, one more than the highest index set */
     int        _nrank;
+    /** The indices of the ranks whose current mask has keyboard bits, the only ones that can play */
+    int       *_active;
+    /** The number of active ranks */
+    int        _nactive;
+    /** A rank or division mask has been changed since the last update (unsigned char *) */
+    bool       _dirty;
     /**
      * Division mask. This is the default mask defining the keyboards to which the ranks in this division should respond
      * when they are set as active
@@ -0,0 +1,98 @@
+// ----------------------------------------------------------------------------
+//
+//  This program is free software; you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation; either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  This program is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+// ----------------------------------------------------------------------------
+
+
+
+#include <sched.h>
+#include <unistd.h>
+#include "genpool.h"
+
+
+Genpool::Genpool (int nthr) :
+    _nthr (nthr),
+    _stop (false),
+    _func (nullptr),
+    _arg (nullptr),
+    _n (0),
+    _next (0)
+{
+    int i;
+
+    if (_nthr < 0) _nthr = (int) sysconf (_SC_NPROCESSORS_ONLN) - 1;
+    if (_nthr < 0) _nthr = 0;
+    _thrs = new Worker * [_nthr];
+    for (i = 0; i < _nthr; i++)
+    {
+        _thrs [i] = new Worker (this);
+        // Normal scheduling, the generation must never compete with the audio thread.
+        if (_thrs [i]->thr_start (SCHED_OTHER, 0, 0x10000))
+        {
+            delete _thrs [i];
+            _nthr = i;
+            break;
+        }
+    }
+}
+
+
+Genpool::~Genpool ()
+{
+    int i;
+
+    _stop = true;
+    for (i = 0; i < _nthr; i++) _thrs [i]->_start.post ();
+    for (i = 0; i < _nthr; i++) _done.wait ();
+    for (i = 0; i < _nthr; i++) delete _thrs [i];
+    delete[] _thrs;
+}
+
+
+void Genpool::run (void (*func)(void *, int), void *arg, int n)
+{
+    int i, k;
+
+    _func = func;
+    _arg = arg;
+    _n = n;
+    _next = 0;
+    // Wake up no more workers than there are items for the others.
+    k = (n - 1 < _nthr) ? n - 1 : _nthr;
+    for (i = 0; i < k; i++) _thrs [i]->_start.post ();
+    work ();
+    for (i = 0; i < k; i++) _done.wait ();
+}
+
+
+void Genpool::work ()
+{
+    int i;
+
+    while ((i = _next++) < _n) _func (_arg, i);
+}
+
+
+void Genpool::Worker::thr_main ()
+{
+    while (true)
+    {
+        _start.wait ();
+        if (_pool->_stop) break;
+        _pool->work ();
+        _pool->_done.post ();
+    }
+    _pool->_done.post ();
+}
@@ -0,0 +1,99 @@
+// ----------------------------------------------------------------------------
+//
+//  This program is free software; you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation; either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  This program is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+// ----------------------------------------------------------------------------
+
+
+
+#ifndef AEOLUS_GENPOOL_H
+#define AEOLUS_GENPOOL_H
+
+
+#include <atomic>
+#include "../../clthreads/include/clthreads.h"
+
+
+/**
+ * Pool of worker threads for the wavetable generation.<br /><br />
+ * run () spreads a number of independent work items, e.g. the pipes of a rank, over the
+ * workers and the calling thread, and returns when all of them are done. The items are
+ * taken in order from a shared counter, so long and short items balance out. The workers
+ * sleep on a semaphore between two calls of run ().<br />
+ * run () must not be called from more than one thread at the same time.
+ */
+class Genpool
+{
+public:
+    /**
+     * Constructor, starts the worker threads
+     * @param nthr Number of workers in addition to the calling thread, negative to use one
+     *             less than the number of online processors
+     */
+    explicit Genpool (int nthr = -1);
+    /**
+     * Destructor, stops the workers and waits until they have left their main loop
+     */
+    ~Genpool ();
+
+    /**
+     * Call func (arg, i) for i = 0 .. n-1, in parallel, and wait until all calls have returned
+     * @param func The work function, it must be safe to call it from several threads at once
+     * @param arg Argument handed to func
+     * @param n Number of work items
+     */
+    void run (void (*func)(void *, int), void *arg, int n);
+    /**
+     * Number of threads doing the work, including the calling one
+     * @return The number of threads
+     */
+    [[nodiscard]] int nthr () const { return _nthr + 1; }
+
+private:
+
+    Genpool (const Genpool&);
+    Genpool& operator=(const Genpool&);
+
+    class Worker : public P_thread
+    {
+    public:
+
+        explicit Worker (Genpool *pool) : _pool (pool) {}
+
+        P_sema    _start;  // posted by run () and by the destructor of the pool
+
+    private:
+
+        void thr_main () override;
+
+        Genpool  *_pool;
+    };
+
+    /**
+     * Take and execute work items until there are none left
+     */
+    void work ();
+
+    int                _nthr;  // number of workers
+    Worker           **_thrs;  // the workers
+    P_sema             _done;  // posted by each worker when it runs out of items, or exits
+    volatile bool      _stop;  // the workers are to exit
+    void             (*_func)(void *, int);
+    void              *_arg;
+    int                _n;     // number of work items
+    std::atomic<int>   _next;  // next work item to be taken
+};
+
+
+#endif
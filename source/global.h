@@ -53,12 +53,16 @@
 #include "lfqueue.h"
 
 
+// The divisions, groups and audio sections are allocated up to these limits, but only those
+// the instrument defines are processed. The keyboards are bits of the 8 bit masks in the
+// commands to the audio thread and in the midi map, together with HOLD_MASK. The ranks of a
+// division are allocated as they are defined, see Divis::NRANK.
 enum // GLOBAL LIMITS
 {
-    NASECT = 4,
-    NDIVIS = 8,
+    NASECT = 8,
+    NDIVIS = 16,
     NKEYBD = 6,
-    NGROUP = 8,
+    NGROUP = 16,
     NNOTES = 61,
     NBANK  = 32,
     NPRES  = 32
@@ -74,7 +74,7 @@ void Imidi::proc_midi_event(const MidiEvent &ev)
 
 
 
-//        d = (_midimap [c] >>  8) & 7;  // Division number if (f & 2)
+//        d = (_midimap [c] >>  8) & 15; // Division number if (f & 2)
     f = (_midimap [c] >> 12) & 7;  // Control enabled if (f & 4)
     t = ev.type;
 
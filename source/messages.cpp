@@ -103,7 +103,7 @@ M_ifc_init *M_ifc_init::createCopy(M_ifc_init *original) {
     }
     __android_log_print(android_LogPriority::ANDROID_LOG_INFO,
                         "Aeolus Messages M_ifc_init", "Copied divisions");
-    for (int i = 0; i < 8; i++) {
+    for (int i = 0; i < NGROUP; i++) {
         if (original->_groupd[i]._label == nullptr) {
             return_value->_groupd[i]._label = nullptr;
         } else {
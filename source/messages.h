@@ -88,7 +88,8 @@ enum
     MT_IFC_APPLY,
     MT_IFC_SAVE,
     MT_IFC_TXTIP,
-    MT_IFC_RETUNING_DONE
+    MT_IFC_RETUNING_DONE,
+    MT_TUNE_RANK
 };
 
 
@@ -155,6 +156,7 @@ public:
     int             _flags;
     int             _dmask; // division keyboard mask
     int             _asect;
+    int             _nrank; // number of ranks
     float           _swell; // swell parameter
     float           _tfreq;
     float           _tmodd;
@@ -175,7 +177,7 @@ class M_def_rank : public ITC_mesg
 {
 public:
 
-    M_def_rank (int type) : ITC_mesg (type) {}
+    M_def_rank (int type) : ITC_mesg (type), _lmax (0), _prio (Rankwave::PRIO_OFF), _dead (nullptr) {}
 
     int             _divis; // The division to which the rank belong
     int             _rank; // The id within the division
@@ -184,9 +186,29 @@ public:
     float           _fsamp; // sampling rate
     float           _fbase; // base frequency for the tuning of the rank
     float          *_scale; // Pointer to the tuning scale
+    int             _lmax; // maximum loop length, see Model::set_lmax
     Addsynth       *_sdef; // Used to transmit some parameters for the rank
     Rankwave       *_wave; // Pointer to the rank
+    int             _prio; // Generation priority, see Rankwave::set_prio
     const char     *_path; // path for the wavetable
+    const char     *_bundle; // path of the wavetable bundle of the instrument, see Wavebundle
+    Rankwave       *_dead; // Rank replaced in the division, returned by the audio thread to be deleted
+};
+
+/**
+ * Retune a rank by its playback rate, without regenerating the wavetables. The model computes the
+ * ratio of the new and the generated frequency of each pipe (Rankwave::ratios) and sends this message
+ * to the Aeolus audio thread, which applies them (Rankwave::retune) and returns the message to the
+ * model for deletion. The ITC message type is MT_TUNE_RANK
+ */
+class M_tune_rank : public ITC_mesg
+{
+public:
+
+    M_tune_rank () : ITC_mesg (MT_TUNE_RANK), _wave (nullptr) {}
+
+    Rankwave       *_wave; // The rank to retune
+    float           _ratio [128]; // Playback rate ratio for each pipe from n0 to n1
 };
 
 /** Message for initialization of the user interface<br />
@@ -213,7 +235,8 @@ public:
     const char         *_stops;
     /** Path to the waves directory.<br />
      * Here, absolute path to the directory holding the wavetables as generated and saved upon loading the ranks
-     * The waves (aka, wavetables) are stored as  .ae1 files in the waves directory.
+     * The waves (aka, wavetables) are stored in one .aeb bundle per instrument in the waves directory,
+     * named after the instrument directory (see Wavebundle). Older versions stored one .ae1 file per rank.
      */
     const char         *_waves;
 
@@ -262,8 +285,8 @@ public:
             const char *_label; // interface element label
             const char *_mnemo; // interace element label short
             int         _type;
-	}               _ifelmd [32]; // interface element definition
-    }                   _groupd [8];  // definition of the groups
+	}               _ifelmd [32]; // interface element definition, Group::NIFELM
+    }                   _groupd [NGROUP];  // definition of the groups
     struct 
     {
         const char     *_label; // tuning label
@@ -355,8 +378,8 @@ public:
 
 /** Message indicating that the synthesizer should be retuned.<br />
  * This message is triggered through jni when the user requests a retuning in Android, and
- * causes AeolusSynthesizer to post a M_ifc_retune message to the model. In response, the model mandates the
- * slave to do the retuning
+ * causes AeolusSynthesizer to post a M_ifc_retune message to the model. In response, the model retunes the
+ * ranks in the audio thread (M_tune_rank), or mandates the slave to regenerate them, see Model::retune
  */
 class M_ifc_retune : public ITC_mesg
 {
@@ -23,16 +23,28 @@
 #include <cstdio>
 #include <cctype>
 #include <ctime>
+#include <new>
+#include <type_traits>
+#include <sys/stat.h>
+#include <unistd.h>
 #include <android/log.h>
 #include "model.h"
 #include "scales.h"
 #include "global.h"
 
 
+extern int isDirectoryExists (const char *path);
+
+
+#define BATCH 256 // commands sent to the audio thread in one batch, see Model::set_ifelms
+
+
 Divis::Divis (void) :
     _flags (0),
     _dmask (0),
-    _nrank (0)
+    _nrank (0),
+    _ranks (nullptr),
+    _mrank (0)
 {
     *_label = 0;
     _param [SWELL]._val = SWELL_DEF;
@@ -47,6 +59,29 @@ Divis::Divis (void) :
 }
 
 
+Divis::~Divis ()
+{
+    delete[] _ranks;
+}
+
+
+Rank *Divis::new_rank ()
+{
+    Rank  *R;
+
+    if (_nrank == NRANK) return nullptr;
+    if (_nrank == _mrank)
+    {
+        _mrank = (2 * _mrank + 8 < NRANK) ? 2 * _mrank + 8 : NRANK;
+        R = new Rank [_mrank];
+        if (_nrank) memcpy (R, _ranks, _nrank * sizeof (Rank));
+        delete[] _ranks;
+        _ranks = R;
+    }
+    return _ranks + _nrank++;
+}
+
+
 
 Keybd::Keybd (void) :
     _flags (0)
@@ -98,6 +133,9 @@ Model::Model (Lfq_u32      *qcomm,
     _nkeybd (0),
     _ngroup (0),
     _count (0),
+    _nwait (0),
+    _nsync (0),
+    _lmax (0),
     _bank (0),
     _pres (0),
     _sc_cmode (0),
@@ -107,6 +145,22 @@ Model::Model (Lfq_u32      *qcomm,
 {
     sprintf (_instr, "%s",  instr);
     sprintf (_waves, "%s", waves);
+    // One wavetable bundle and one compiled image per instrument, named after its directory.
+    // A path that does not fit would name another file, then there is none: without the bundle the
+    // ranks are generated, and without the image the instrument is read from its text files, every time.
+    {
+        char  name [1024], *p;
+        snprintf (name, 1024, "%s", instr);
+        while ((p = strrchr (name, '/')) && ! p [1] && (p > name)) *p = 0;
+        p = strrchr (name, '/');
+        if (snprintf (_bundle, sizeof (_bundle), "%s/%s.aeb", _waves, p ? p + 1 : name) >= (int) sizeof (_bundle)) *_bundle = 0;
+        if (snprintf (_image, sizeof (_image), "%s/%s.aei", _waves, p ? p + 1 : name) >= (int) sizeof (_image)) *_image = 0;
+        if (! *_bundle || ! *_image)
+        {
+            __android_log_print(android_LogPriority::ANDROID_LOG_WARN,
+                                "Aeolus Model", "Path too long for the wavetable bundle or image of '%s'", name);
+        }
+    }
 
     memset (_preset, 0, NBANK * NPRES * sizeof (Preset *));
 }
@@ -160,14 +214,22 @@ void Model::thr_main ()
 
 void Model::init ()
 {
-    read_instr ();
-    read_presets ();
+    int  e;
+
+    if (read_image ())
+    {
+        // Compiled again from the text files, and then used until one of them changes.
+        e = read_instr ();
+        read_presets ();
+        if (! e) write_image ();
+    }
 }
 
 
 void Model::fini ()
 {
     write_presets ();
+    write_image ();
 }
 
 
@@ -217,7 +279,7 @@ void Model::proc_mesg (ITC_mesg *M)
     }
     case MT_IFC_RETUNE:
     {
-	// Recalculate all wavetables.
+	// Retune all ranks, see retune ().
         _isRetuning=true;
         M_ifc_retune *X = (M_ifc_retune *) M;
         retune (X->_freq, X->_temp);
@@ -328,7 +390,7 @@ void Model::proc_mesg (ITC_mesg *M)
     {
 	// Apply edited stop.
 	M_ifc_edit *X = (M_ifc_edit *) M;
-        if (_ready) recalc (X->_group, X->_ifelm);
+        if (_count && ! _nwait) recalc (X->_group, X->_ifelm);
 	break;
     }
     case MT_IFC_SAVE:
@@ -342,8 +404,14 @@ void Model::proc_mesg (ITC_mesg *M)
 	// Load a rank into a division.
         M_def_rank *X = (M_def_rank *) M; 
         _divis [X->_divis]._ranks [X->_rank]._wave = X->_wave;
+        delete X->_dead;
+        _nwait--;
 	break;
     }
+    case MT_TUNE_RANK:
+	// Rank retuned by the audio thread, only the message is left to delete.
+	break;
+
     case MT_AUDIO_INFO:
     {
 	// Initialisation info from audio thread.
@@ -383,13 +451,19 @@ void Model::proc_mesg (ITC_mesg *M)
 	break;
 
     case MT_AUDIO_SYNC:
-	// Wavetable calculation done.
+	// Wavetable calculation done, unless a later one is still under way.
+        if (--_nsync) break;
         save_ranks();
          send_event (TO_IFACE, new ITC_mesg (MT_IFC_READY));
         _ready = true;
         if(_isRetuning) {
             _isRetuning = false;
             send_event( TO_IFACE, new ITC_mesg( MT_IFC_RETUNING_DONE));
+#if RETUNE_RATE && RETUNE_REGEN
+            // The organ already plays in the new tuning, now replace the
+            // retuned wavetables by ones generated for it.
+            init_ranks (MT_CALC_RANK);
+#endif
         }
 	break;
 
@@ -417,7 +491,7 @@ void Model::proc_qmidi ()
 	v = _qmidi->read (2);
 	_qmidi->read_commit (3);
 	c = t & 0x0F;
-        d = (_midimap [c] >>  8) & 7;
+        d = (_midimap [c] >>  8) & 15;
 	switch (t & 0xF0)
         {
 	case 0x90:
@@ -492,6 +566,7 @@ void Model::init_audio ()
         M->_flags = D->_flags;
         M->_dmask = D->_dmask;
         M->_asect = D->_asect;
+        M->_nrank = D->_nrank;
         M->_swell = D->_param [Divis::SWELL]._val;
         M->_tfreq = D->_param [Divis::TFREQ]._val;
         M->_tmodd = D->_param [Divis::TMODD]._val;
@@ -591,28 +666,112 @@ void Model::init_iface (void)
 
 void Model::init_ranks (int comm)
 {
-    int    g, i;
+    int    g, i, p;
     Group  *G;
 
     _count++;
     _ready = false;
     send_event (TO_IFACE, new M_ifc_retune (_fbase, _itemp));
+    if (comm != MT_TUNE_RANK) set_lmax ();
 
-    for (g = 0; g < _ngroup; g++)
+    // Drawn stops first, then those of the current preset bank, then the others.
+    for (p = Rankwave::PRIO_ON; p <= Rankwave::PRIO_OFF; p++)
     {
-	G = _group + g;
-	for (i = 0; i < G->_nifelm; i++) proc_rank (g, i, comm);
+        for (g = 0; g < _ngroup; g++)
+        {
+	    G = _group + g;
+	    for (i = 0; i < G->_nifelm; i++) if (rank_prio (g, i) == p) proc_rank (g, i, comm, p);
+        }
     }
     send_event (TO_SLAVE, new ITC_mesg (MT_AUDIO_SYNC));
+    _nsync++;
 }
 
 
-void Model::proc_rank (int g, int i, int comm)
+void Model::set_lmax ()
 {
-    int         d, r;
-    M_def_rank  *M;
-    Ifelm       *I;
-    Rank        *R;
+    size_t  k;
+
+    _lmax = (int)(_audio->_fsamp / 6.0f);
+    k = wavesize (_lmax);
+#if WAVE_BUDGET
+    int lmin = (int)(_audio->_fsamp / 48.0f);
+    while ((k > (size_t) WAVE_BUDGET << 20) && (_lmax > lmin))
+    {
+        _lmax = (3 * _lmax) / 4;
+        if (_lmax < lmin) _lmax = lmin;
+        k = wavesize (_lmax);
+    }
+#endif
+    __android_log_print(android_LogPriority::ANDROID_LOG_INFO,
+                        "Model::set_lmax", "Wavetables %.1f MB, maximum loop length %d", k / 1048576.0, _lmax);
+}
+
+
+size_t Model::wavesize (int lmax)
+{
+    int     d, r;
+    size_t  k;
+    Rank    *R;
+
+    k = 0;
+    for (d = 0; d < _ndivis; d++)
+    {
+        for (r = 0; r < _divis [d]._nrank; r++)
+        {
+            // The ranks may not exist yet, so a temporary one is used.
+            R = _divis [d]._ranks + r;
+            if (! R->_sdef) continue;
+            Rankwave W (R->_sdef->_n0, R->_sdef->_n1);
+            k += W.wavesize (R->_sdef, _audio->_fsamp, _fbase, scales [_itemp]._data, lmax);
+        }
+    }
+    return k;
+}
+
+
+int Model::rank_prio (int g, int i)
+{
+    int  p;
+
+    if (_group [g]._ifelms [i]._state) return Rankwave::PRIO_ON;
+    for (p = 0; p < NPRES; p++)
+    {
+        if (_preset [_bank][p] && (_preset [_bank][p]->_bits [g] & (1 << i))) return Rankwave::PRIO_BANK;
+    }
+    return Rankwave::PRIO_OFF;
+}
+
+
+void Model::set_prio (int g, int i, int p)
+{
+    int     d, r;
+    Ifelm   *I;
+
+    I = _group [g]._ifelms + i;
+    if ((I->_type != Ifelm::DIVRANK) && (I->_type != Ifelm::KBDRANK)) return;
+#if MULTISTOP
+    for (uint32_t *a = I->_action [0]; *a; ++a)
+    {
+        d = (*a >> 16) & 255;
+        r = (*a >>  8) & 255;
+        if (_divis [d]._ranks [r]._wave) _divis [d]._ranks [r]._wave->set_prio (p);
+    }
+#else
+    d = (I->_action0 >> 16) & 255;
+    r = (I->_action0 >>  8) & 255;
+    if (_divis [d]._ranks [r]._wave) _divis [d]._ranks [r]._wave->set_prio (p);
+#endif
+}
+
+
+void Model::proc_rank (int g, int i, int comm, int prio)
+{
+    int           d, r;
+    M_def_rank    *M;
+    M_tune_rank   *T;
+    Ifelm         *I;
+    Rank          *R;
 
     __android_log_print(android_LogPriority::ANDROID_LOG_INFO,
                         "Model::proc_rank", "fsamp %f",_audio->_fsamp);
@@ -630,7 +789,19 @@ void Model::proc_rank (int g, int i, int comm)
         r = (I->_action0 >>  8) & 255;
 #endif
         R = _divis [d]._ranks + r;
-        if (comm == MT_SAVE_RANK)
+        if (comm == MT_TUNE_RANK)
+        {
+            // Rates for the current tuning, applied by the audio thread.
+            if (R->_count != _count)
+            {
+                R->_count = _count;
+                T = new M_tune_rank ();
+                T->_wave = R->_wave;
+                R->_wave->ratios (R->_sdef, _fbase, scales [_itemp]._data, T->_ratio);
+                send_event (TO_AUDIO, T);
+            }
+        }
+        else if (comm == MT_SAVE_RANK)
         {
 	    if (R->_wave->modif ())
 	    {
@@ -641,6 +812,7 @@ void Model::proc_rank (int g, int i, int comm)
 	        M->_sdef  = R->_sdef;
 	        M->_wave  = R->_wave;
   	        M->_path  = _waves;
+  	        M->_bundle = _bundle;
 	        send_event (TO_SLAVE, M);
 	    }
 	}
@@ -655,9 +827,13 @@ void Model::proc_rank (int g, int i, int comm)
 	    M->_fsamp = _audio->_fsamp;
 	    M->_fbase = _fbase;
 	    M->_scale = scales [_itemp]._data;
+	    M->_lmax  = _lmax;
 	    M->_sdef  = R->_sdef;
 	    M->_wave  = R->_wave;
+	    M->_prio  = prio;
 	    M->_path  = _waves;
+	    M->_bundle = _bundle;
+	    _nwait++;
 	    send_event (TO_SLAVE, M);
 	}
 #if MULTISTOP
@@ -669,69 +845,108 @@ void Model::proc_rank (int g, int i, int comm)
 
 void Model::set_ifelm (int g, int i, int m)
 {
-    int    s;
-    Ifelm  *I;
-    Group  *G;
-
-
+    uint32_t  bits [NGROUP], mask [NGROUP];
+    Group     *G;
 
     G = _group + g;
-    if ((! _ready) || (g >= _ngroup) || (i >= G->_nifelm)){
+    // Stops can be drawn as soon as all ranks are in the audio thread, while
+    // their pipes may still be generated.
+    if ((! _count) || _nwait || (g >= _ngroup) || (i >= G->_nifelm)){
         __android_log_print(android_LogPriority::ANDROID_LOG_INFO,
                             "Aeolus Model", "Issue setting interface element %d %d %d",g,i,m);
         return;
     }
-    I = G->_ifelms + i;
-    s = (m == 2) ? I->_state ^ 1 : m;
+    memset (mask, 0, sizeof (mask));
+    get_state (bits);
+    mask [g] = 1u << i;
+    if (m == 2) bits [g] ^= mask [g];
+    else if (m) bits [g] |= mask [g];
+    else bits [g] &= ~mask [g];
+    set_ifelms (bits, mask);
+}
+
+
+void Model::clr_group (int g)
+{
+    uint32_t  bits [NGROUP], mask [NGROUP];
+
+    if ((! _count) || _nwait || (g >= _ngroup)) return;
+
+    memset (bits, 0, sizeof (bits));
+    memset (mask, 0, sizeof (mask));
+    mask [g] = ~0u;
+    set_ifelms (bits, mask);
+    send_event (TO_IFACE, new M_ifc_ifelm (MT_IFC_GRCLR, g, 0));         
+}
+
+
+int Model::ifelm_comm (Ifelm *I, int s, uint32_t *a)
+{
+    int  n;
 
-    if (I->_state != s)
-    {
-        
-	I->_state = s;
-        if (_qcomm->write_avail ())
-	{
 #if MULTISTOP
-            uint32_t* a = s ? I->_action[1] : I->_action[0];
-            while (*a)
-            {
-              _qcomm->write (0, *a);
-              _qcomm->write_commit (1);
-              send_event (TO_IFACE, new M_ifc_ifelm (MT_IFC_ELCLR + s, g, i));
-              ++a;
-            }
+    const uint32_t *p = s ? I->_action [1] : I->_action [0];
+    for (n = 0; (n < 8) && p [n]; n++) a [n] = p [n];
 #else
-            _qcomm->write (0, s ? I->_action0 : I->_action0);
-            _qcomm->write_commit (1);
-            send_event (TO_IFACE, new M_ifc_ifelm (MT_IFC_ELCLR + s, g, i));
+    n = 0;
+    a [n++] = s ? I->_action1 : I->_action0;
 #endif
-	}
-    }
+    return n;
 }
 
 
-void Model::clr_group (int g)
+void Model::set_ifelms (const uint32_t *bits, const uint32_t *mask)
 {
-    int     i;
-    Ifelm  *I;
-    Group  *G;    
+    int       g, i, n, s;
+    uint32_t  a [BATCH + 8];
+    Group     *G;
+    Ifelm     *I;
 
-    G = _group + g;
-    if ((! _ready) || (g >= _ngroup)) return;
+    if ((! _count) || _nwait) return;
 
-    for (i = 0; i < G->_nifelm; i++)
+    n = 0;
+    for (g = 0; g < _ngroup; g++)
     {
-        I = G->_ifelms + i;
-        if (I->_state)
+        G = _group + g;
+        for (i = 0; i < G->_nifelm; i++)
         {
-	    I->_state = 0;
-            if (_qcomm->write_avail ())
-	    {
-	       _qcomm->write (0, I->_action0);  
-               _qcomm->write_commit (1);
-	    }
-	}
+            if (! ((mask [g] >> i) & 1)) continue;
+            I = G->_ifelms + i;
+            s = (bits [g] >> i) & 1;
+            if (I->_state == s) continue;
+	    I->_state = s;
+            // A stop drawn before it is ready goes to the front of the generation.
+            if (s && ! _ready) set_prio (g, i, Rankwave::PRIO_ON);
+            n += ifelm_comm (I, s, a + n);
+            if (n >= BATCH)
+            {
+                send_batch (a, n);
+                n = 0;
+            }
+            send_event (TO_IFACE, new M_ifc_ifelm (MT_IFC_ELCLR + s, g, i));
+        }
+    }
+    send_batch (a, n);
+}
+
+
+void Model::send_batch (const uint32_t *a, int n)
+{
+    int  i, k;
+
+    while (n)
+    {
+        // A header with the number of commands, all committed at once, so that the audio
+        // thread applies them in one period. Commands that don't fit are lost, as before.
+        k = _qcomm->write_avail () - 1;
+        if (k <= 0) return;
+        if (k > n) k = n;
+        _qcomm->write (0, (18 << 24) | k);
+        for (i = 0; i < k; i++) _qcomm->write (i + 1, a [i]);
+        _qcomm->write_commit (k + 1);
+        a += k;
+        n -= k;
     }
-    send_event (TO_IFACE, new M_ifc_ifelm (MT_IFC_GRCLR, g, 0));         
 }
 
 
@@ -758,24 +973,15 @@ void Model::get_state (uint32_t *d)
 
 void Model::set_state (int bank, int pres)
 {
-    int    g, i;
-    uint32_t    d [NGROUP], s;
-    Group  *G;
+    uint32_t    d [NGROUP], m [NGROUP];
 
     _bank = bank;
     _pres = pres;
     if (get_preset (bank, pres, d))
     {
-        for (g = 0; g < _ngroup; g++)
-        {
-            s = d [g];
-            G = _group + g;
-            for (i = 0; i < G->_nifelm; i++)
-	    {
-                set_ifelm (g, i, s & 1);
-                s >>= 1;
-	    }
-	}
+        // Only the elements that change, in one batch.
+        memset (m, 0xFF, sizeof (m));
+        set_ifelms (d, m);
         send_event (TO_IFACE, new M_ifc_preset (MT_IFC_PRRCL, bank, pres, _ngroup, d));
     }
     else send_event (TO_IFACE, new M_ifc_preset (MT_IFC_PRRCL, bank, pres, 0, 0));
@@ -828,7 +1034,7 @@ void Model::set_mconf (int i, uint16_t *d)
 	    b =  (a & 0x1000) ? (_keybd [a & 7]._flags & 127) : 0;
 
 
-        b |= a & 0x7700; // keep the upper byte as is
+        b |= a & 0x7F00; // keep the upper byte as is, the division number is bits 8 to 11
         if((a & 7)==7) // To be used as special preset such as to have channel 0 play on all keys
         {
             b |= 0x007F;
@@ -853,11 +1059,18 @@ void Model::midi_off (int mask)
 
 void Model::retune (float freq, int temp)
 {
-    if (_ready)
+    // A retune may follow another one before it is done: the slave then drops the
+    // ranks still being generated for the earlier one.
+    if (_count && ! _nwait)
     {
 	_fbase = freq;
         _itemp = temp;
+#if RETUNE_RATE
+        // Ranks that may still be generating can't be retuned by rate.
+        init_ranks (_ready ? MT_TUNE_RANK : MT_CALC_RANK);
+#else
         init_ranks (MT_CALC_RANK);
+#endif
     }
     else send_event (TO_IFACE, new M_ifc_retune (_fbase, _itemp));
 }
@@ -869,6 +1082,7 @@ void Model::recalc (int g, int i)
     _ready = false;
     proc_rank (g, i, MT_CALC_RANK);
     send_event (TO_SLAVE, new ITC_mesg (MT_AUDIO_SYNC));
+    _nsync++;
 }
 
 
@@ -879,6 +1093,7 @@ void Model::save ()
 
     write_instr ();
     write_presets ();
+    write_image ();
     _ready = false;
     for (g = 0; g < _ngroup; g++)
     {
@@ -886,6 +1101,7 @@ void Model::save ()
 	for (i = 0; i < G->_nifelm; i++) proc_rank (g, i, MT_SAVE_RANK);
     }
     send_event (TO_SLAVE, new ITC_mesg (MT_AUDIO_SYNC));
+    _nsync++;
 }
 
 
@@ -1114,7 +1330,7 @@ int Model::read_instr ()
 		    {   
                         A->_pan = c;
                         A->_del = d; 
-			R = D->_ranks + D->_nrank++; 
+			R = D->new_rank (); 
                         R->_count = 0;
                         R->_sdef = A;
                         R->_wave = nullptr;
@@ -1526,16 +1742,7 @@ int Model::read_presets ()
     FILE           *F;
     Preset         *P;
 
-    if (_uhome)
-    {
-        p = (unsigned char *)(getenv ("HOME"));
-        if (p) sprintf (name, "%s/.aeolus-presets", p);
-        else strcpy (name, ".aeolus-presets");
-    }
-    else
-    {
-	sprintf (name, "%s/presets", _instr);
-    }
+    presetname (name);
     __android_log_print(android_LogPriority::ANDROID_LOG_INFO,
                         "Aeolus Model", "Preset file %s",name);
     if (! (F = fopen (name, "r"))) 
@@ -1625,16 +1832,7 @@ int Model::write_presets (void)
     FILE           *F;
     Preset         *P;
 
-    if (_uhome)
-    {
-        p = (unsigned char *)(getenv ("HOME"));
-        if (p) sprintf (name, "%s/.aeolus-presets", p);
-        else strcpy (name, ".aeolus-presets");
-    }
-    else
-    {
-	sprintf (name, "%s/presets", _instr);
-    }
+    presetname (name);
     if (! (F = fopen (name, "w"))) 
     {
 	fprintf (stderr, "Can't open '%s' for writing\n", name);
@@ -1689,6 +1887,394 @@ int Model::write_presets (void)
     return 0;
 }
 
+
+void Model::presetname (char *name)
+{
+    char  *p;
+
+    if (_uhome)
+    {
+        p = getenv ("HOME");
+        if (p) sprintf (name, "%s/.aeolus-presets", p);
+        else strcpy (name, ".aeolus-presets");
+    }
+    else
+    {
+	sprintf (name, "%s/presets", _instr);
+    }
+}
+
+
+// Compiled instrument image: a 64 byte header with the tag "aei", the version and the sizes
+// the layout depends on, then the files it was compiled from, each with its modification time
+// and size, the path of the wavetable bundle, the keyboards, the divisions with the synthesis
+// parameters of their ranks, the groups, the tuning, the midi channel configurations and the
+// presets. Strings are stored with their length, structures as they are in memory, the image
+// is only meant to be read by the same build.
+
+static_assert (std::is_trivially_copyable <Addsynth>::value, "Addsynth is stored as it is");
+static_assert (std::is_trivially_copyable <Keybd>::value, "Keybd is stored as it is");
+static_assert (std::is_trivially_copyable <Fparm>::value, "Fparm is stored as it is");
+static_assert (std::is_trivially_copyable <Chconf>::value, "Chconf is stored as it is");
+static_assert (std::is_trivially_copyable <Preset>::value, "Preset is stored as it is");
+
+static const int32_t image_layout [] =
+{
+    sizeof (Addsynth), sizeof (Keybd), sizeof (Fparm), sizeof (Chconf), sizeof (Preset),
+    NASECT, NKEYBD, NDIVIS, NGROUP, Divis::NRANK, Divis::NPARAM, Group::NIFELM, MULTISTOP
+};
+
+
+static void image_stat (const char *name, int64_t *t, int64_t *s)
+{
+    struct stat  S;
+
+    if (stat (name, &S))
+    {
+        // A file that does not exist yet, the image is compiled again once it does.
+        *t = -1;
+        *s = -1;
+    }
+    else
+    {
+        *t = (int64_t) S.st_mtim.tv_sec * 1000000000 + S.st_mtim.tv_nsec;
+        *s = S.st_size;
+    }
+}
+
+
+int Model::read_image ()
+{
+    int            i, j, k, n;
+    int32_t        v [5];
+    int64_t        t, s, t1, s1;
+    char           name [1200];
+    char           pres [1200];
+    const char    *d, *e;
+    Wavemap       *M;
+    Divis         *D;
+    Rank          *R;
+    Group         *G;
+    Ifelm         *I;
+    Addsynth      *A;
+    Preset        *P;
+    bool           ok;
+
+    if (! *_image || ! (M = Wavemap::open (_image))) return 1;
+    d = M->data ();
+    e = d + M->size ();
+
+    // Copies the next n bytes of the image, false past its end.
+    auto get = [&d, e] (void *p, size_t n)
+    {
+        if ((size_t)(e - d) < n) return false;
+        memcpy (p, d, n);
+        d += n;
+        return true;
+    };
+    // The next string, false if it does not fit into m characters.
+    auto getstr = [&get] (char *p, int m)
+    {
+        int32_t  n;
+
+        if (! get (&n, sizeof (n)) || (n < 0) || (n >= m) || ! get (p, n)) return false;
+        p [n] = 0;
+        return true;
+    };
+
+    ok = (M->size () >= 64) && ! strcmp (d, "aei") && (d [4] == 1)
+         && ! memcmp (d + 8, image_layout, sizeof (image_layout));
+    d += 64;
+
+    // The files it was compiled from, unchanged.
+    sprintf (pres, "%s/definition", _instr);
+    ok = ok && get (&n, sizeof (n)) && (n >= 2);
+    for (i = 0; ok && (i < n); i++)
+    {
+        ok = getstr (name, 1200) && get (&t, sizeof (t)) && get (&s, sizeof (s));
+        // The definition first, then the presets, which depend on _uhome.
+        if (ok && (i == 0)) ok = ! strcmp (name, pres);
+        if (ok && (i == 1))
+        {
+            presetname (pres);
+            ok = ! strcmp (name, pres);
+        }
+        if (ok)
+        {
+            image_stat (name, &t1, &s1);
+            ok = (t == t1) && (s == s1);
+        }
+    }
+    if (! ok)
+    {
+        M->release ();
+        return 1;
+    }
+
+    ok = getstr (name, 1024)
+         && get (v, 5 * sizeof (int32_t))
+         && (v [0] >= 0) && (v [0] <= NASECT)
+         && (v [1] >= 0) && (v [1] <= NKEYBD)
+         && (v [2] >= 0) && (v [2] <= NDIVIS)
+         && (v [3] >= 0) && (v [3] <= NGROUP)
+         && get (&_fbase, sizeof (_fbase))
+         && get (&_itemp, sizeof (_itemp))
+         && get (_keybd, v [1] * sizeof (Keybd));
+    if (ok)
+    {
+        _nasect = v [0];
+        _nkeybd = v [1];
+    }
+    n = ok ? v [2] : 0;
+    k = ok ? v [3] : 0;
+
+    for (i = 0; ok && (i < n); i++)
+    {
+        D = _divis + _ndivis++;
+        ok = get (D->_label, sizeof (D->_label))
+             && get (v, 5 * sizeof (int32_t))
+             && (v [2] >= 0) && (v [2] <= Divis::NRANK)
+             && get (D->_param, sizeof (D->_param));
+        if (! ok) break;
+        D->_flags = v [0];
+        D->_dmask = v [1];
+        D->_asect = v [3];
+        D->_keybd = v [4];
+        for (j = 0; ok && (j < v [2]); j++)
+        {
+            A = new Addsynth;
+            if ((ok = get (A, sizeof (Addsynth))))
+            {
+                R = D->new_rank ();
+                R->_count = 0;
+                R->_sdef = A;
+                R->_wave = nullptr;
+            }
+            else delete A;
+        }
+    }
+
+    for (i = 0; ok && (i < k); i++)
+    {
+        G = _group + _ngroup++;
+        ok = get (G->_label, sizeof (G->_label))
+             && get (&n, sizeof (n))
+             && (n >= 0) && (n <= Group::NIFELM);
+        for (j = 0; ok && (j < n); j++)
+        {
+            I = G->_ifelms + j;
+            ok = get (I->_label, sizeof (I->_label))
+                 && get (I->_mnemo, sizeof (I->_mnemo))
+                 && get (&I->_type, sizeof (I->_type))
+                 && get (&I->_keybd, sizeof (I->_keybd))
+#if MULTISTOP
+                 && get (I->_action, sizeof (I->_action));
+#else
+                 && get (&I->_action0, sizeof (I->_action0))
+                 && get (&I->_action1, sizeof (I->_action1));
+#endif
+            if (ok) G->_nifelm++;
+        }
+    }
+
+    ok = ok && get (_chconf, sizeof (_chconf)) && get (&n, sizeof (n));
+    for (i = 0; ok && (i < n); i++)
+    {
+        ok = get (v, 2 * sizeof (int32_t))
+             && (v [0] >= 0) && (v [0] < NBANK) && (v [1] >= 0) && (v [1] < NPRES);
+        if (ok)
+        {
+            P = new Preset;
+            if ((ok = get (P->_bits, _ngroup * sizeof (uint32_t))))
+            {
+                delete _preset [v [0]][v [1]];
+                _preset [v [0]][v [1]] = P;
+            }
+            else delete P;
+        }
+    }
+    ok = ok && (d == e);
+    M->release ();
+
+    if (! ok)
+    {
+        // Back to the state before, for read_instr ().
+        __android_log_print(android_LogPriority::ANDROID_LOG_ERROR,
+                            "Aeolus Model", "Instrument image '%s' is not valid", _image);
+        for (i = 0; i < _ndivis; i++)
+        {
+            for (j = 0; j < _divis [i]._nrank; j++) delete _divis [i]._ranks [j]._sdef;
+            _divis [i].~Divis ();
+            new (_divis + i) Divis ();
+        }
+        for (i = 0; i < _ngroup; i++)
+        {
+            _group [i].~Group ();
+            new (_group + i) Group ();
+        }
+        for (i = 0; i < NBANK; i++)
+        {
+            for (j = 0; j < NPRES; j++)
+            {
+                delete _preset [i][j];
+                _preset [i][j] = nullptr;
+            }
+        }
+        _nasect = _nkeybd = _ndivis = _ngroup = 0;
+        return 1;
+    }
+    strcpy (_bundle, name);
+
+    __android_log_print(android_LogPriority::ANDROID_LOG_INFO,
+                        "Aeolus Model", "Read instrument image '%s'", _image);
+    return 0;
+}
+
+
+int Model::write_image ()
+{
+    int            i, j, n;
+    int32_t        v [5];
+    char           name [1200];
+    char           temp [1200];
+    FILE          *F;
+    Divis         *D;
+    Group         *G;
+    Ifelm         *I;
+    Preset        *P;
+
+    if (! *_image) return 1;
+    if (! isDirectoryExists (_waves)) mkdir (_waves, 0777);
+    snprintf (temp, sizeof (temp), "%s.tmp", _image);
+    if (! (F = fopen (temp, "wb")))
+    {
+        __android_log_print(android_LogPriority::ANDROID_LOG_ERROR,
+                            "Aeolus Model", "Can't open '%s' for writing", temp);
+        return 1;
+    }
+
+    auto put = [F] (const void *p, size_t n) { fwrite (p, 1, n, F); };
+    auto putstr = [&put] (const char *p)
+    {
+        int32_t  n = strlen (p);
+
+        put (&n, sizeof (n));
+        put (p, n);
+    };
+    auto putsrc = [&put, &putstr] (const char *name)
+    {
+        int64_t  t, s;
+
+        image_stat (name, &t, &s);
+        putstr (name);
+        put (&t, sizeof (t));
+        put (&s, sizeof (s));
+    };
+
+    memset (temp, 0, 64);
+    strcpy (temp, "aei");
+    temp [4] = 1;
+    memcpy (temp + 8, image_layout, sizeof (image_layout));
+    put (temp, 64);
+
+    // The definition, the presets and the files of the stops, in the order read_image () checks them.
+    n = 2;
+    for (i = 0; i < _ndivis; i++) n += _divis [i]._nrank;
+    put (&n, sizeof (n));
+    sprintf (name, "%s/definition", _instr);
+    putsrc (name);
+    presetname (name);
+    putsrc (name);
+    for (i = 0; i < _ndivis; i++)
+    {
+        D = _divis + i;
+        for (j = 0; j < D->_nrank; j++)
+        {
+            snprintf (name, 1200, "%s/%s", _stops, D->_ranks [j]._sdef->_filename);
+            putsrc (name);
+        }
+    }
+
+    putstr (_bundle);
+    v [0] = _nasect;
+    v [1] = _nkeybd;
+    v [2] = _ndivis;
+    v [3] = _ngroup;
+    v [4] = 0;
+    put (v, 5 * sizeof (int32_t));
+    put (&_fbase, sizeof (_fbase));
+    put (&_itemp, sizeof (_itemp));
+    put (_keybd, _nkeybd * sizeof (Keybd));
+
+    for (i = 0; i < _ndivis; i++)
+    {
+        D = _divis + i;
+        v [0] = D->_flags;
+        v [1] = D->_dmask;
+        v [2] = D->_nrank;
+        v [3] = D->_asect;
+        v [4] = D->_keybd;
+        put (D->_label, sizeof (D->_label));
+        put (v, 5 * sizeof (int32_t));
+        put (D->_param, sizeof (D->_param));
+        for (j = 0; j < D->_nrank; j++) put (D->_ranks [j]._sdef, sizeof (Addsynth));
+    }
+
+    for (i = 0; i < _ngroup; i++)
+    {
+        G = _group + i;
+        put (G->_label, sizeof (G->_label));
+        put (&G->_nifelm, sizeof (G->_nifelm));
+        for (j = 0; j < G->_nifelm; j++)
+        {
+            I = G->_ifelms + j;
+            put (I->_label, sizeof (I->_label));
+            put (I->_mnemo, sizeof (I->_mnemo));
+            put (&I->_type, sizeof (I->_type));
+            put (&I->_keybd, sizeof (I->_keybd));
+#if MULTISTOP
+            put (I->_action, sizeof (I->_action));
+#else
+            put (&I->_action0, sizeof (I->_action0));
+            put (&I->_action1, sizeof (I->_action1));
+#endif
+        }
+    }
+
+    put (_chconf, sizeof (_chconf));
+    for (i = n = 0; i < NBANK; i++)
+    {
+        for (j = 0; j < NPRES; j++) if (_preset [i][j]) n++;
+    }
+    put (&n, sizeof (n));
+    for (i = 0; i < NBANK; i++)
+    {
+        for (j = 0; j < NPRES; j++)
+        {
+            P = _preset [i][j];
+            if (P)
+            {
+                v [0] = i;
+                v [1] = j;
+                put (v, 2 * sizeof (int32_t));
+                put (P->_bits, _ngroup * sizeof (uint32_t));
+            }
+        }
+    }
+
+    // Written to a temporary file that then replaces the old image, so that it is always complete.
+    snprintf (temp, sizeof (temp), "%s.tmp", _image);
+    if (ferror (F) | fclose (F) | rename (temp, _image))
+    {
+        __android_log_print(android_LogPriority::ANDROID_LOG_ERROR,
+                            "Aeolus Model", "Can't write instrument image '%s'", _image);
+        unlink (temp);
+        return 1;
+    }
+    return 0;
+}
+
+
 void Model::save_ranks() {
     __android_log_print(android_LogPriority::ANDROID_LOG_INFO,
                         "Aeolus Model", "save_ranks");
@@ -33,6 +33,18 @@
 # define MULTISTOP 1
 #endif
 
+#ifndef RETUNE_RATE // Retune by the playback rate of the existing wavetables instead of regenerating them
+# define RETUNE_RATE 1
+#endif
+
+#ifndef RETUNE_REGEN // With RETUNE_RATE, regenerate the wavetables for the new tuning afterwards
+# define RETUNE_REGEN 0
+#endif
+
+#ifndef WAVE_BUDGET // Memory for the wavetables of the instrument in MB, 0 for no limit, see Model::set_lmax
+# define WAVE_BUDGET 0
+#endif
+
 class Asect
 {
 public:
@@ -61,10 +73,18 @@ class Divis
 {
 public:
 
-    enum { HAS_SWELL = 1, HAS_TREM = 2, NRANK = 32 };
+    // At most NRANK ranks, their index is 8 bits in the commands to the audio thread.
+    enum { HAS_SWELL = 1, HAS_TREM = 2, NRANK = 256 };
     enum { SWELL, TFREQ, TMODD, NPARAM };
 
     Divis ();
+    ~Divis ();
+
+    /**
+     * Add a rank, growing the array of ranks as needed
+     * @return The new rank, uninitialized, or nullptr if there are NRANK ranks already
+     */
+    Rank *new_rank ();
 
     char        _label [16]; // The label of the division
     /** Division flags indicating division configuration:
@@ -77,7 +97,13 @@ public:
     int         _asect; // index of the audio section associated with the division
     int         _keybd; // keyboard nominally associated with the keyboards
     Fparm       _param [NPARAM]; // division common parameters (SWELL, TFEQ, TMODD, NPARAM) listed above
-    Rank        _ranks [NRANK]; //N division ranks
+    Rank       *_ranks; // division ranks, _nrank of them
+    int         _mrank; // allocated ranks
+
+private:
+
+    Divis (const Divis&);
+    Divis& operator=(const Divis&);
 };
 
 // Keyboard for playing the division
@@ -134,6 +160,7 @@ class Group
 {
 public:
 
+    // A preset holds the state of the elements of a group in one 32 bit word, see Preset::_bits.
     enum { NIFELM = 32 };
 
     Group ();
@@ -232,17 +259,48 @@ private:
      */
     void init_iface ();
     /**
-     * Calculate or load ranks
-     * @param comm MT_CALC_RANK for calculating the new ranks or MT_LOAD_RANK for loading the ranks from their wavetable file
+     * Calculate, load or retune ranks
+     * @param comm MT_CALC_RANK for calculating the new ranks, MT_LOAD_RANK for loading the ranks from their wavetable file,
+     *             or MT_TUNE_RANK for retuning them by their playback rate
      */
     void init_ranks (int comm);
-    /** Process a given rank. Processing means either to (re-)calculate for comm=MT_CALC_RANK or
-     * to load from a file for comm=MT_LOAD_RANK
+    /** Process a given rank. Processing means either to (re-)calculate for comm=MT_CALC_RANK,
+     * to load from a file for comm=MT_LOAD_RANK, to retune the existing wavetables to the current tuning
+     * for comm=MT_TUNE_RANK, or to save the wavetables for comm=MT_SAVE_RANK
      * @param g User interface group
      * @param i Index of rank in user interface group
-     * @param comm MT_CALC_RANK for calculating the new rank or MT_LOAD_RANK for loading the rank from the wavetable file
+     * @param comm MT_CALC_RANK, MT_LOAD_RANK, MT_TUNE_RANK or MT_SAVE_RANK
+     * @param prio Generation priority for MT_CALC_RANK and MT_LOAD_RANK, see Rankwave::set_prio
+     */
+    void proc_rank (int g, int i, int comm, int prio = Rankwave::PRIO_ON);
+    /**
+     * Generation priority of the ranks of an interface element, from its state and the presets of
+     * the current bank
+     * @param g User interface group
+     * @param i Index of the interface element in the group
+     * @return Rankwave::PRIO_ON, PRIO_BANK or PRIO_OFF
+     */
+    int rank_prio (int g, int i);
+    /**
+     * Change the generation priority of the ranks of an interface element, for those that are
+     * still being generated
+     * @param g User interface group
+     * @param i Index of the interface element in the group
+     * @param p The new priority, see Rankwave::set_prio
      */
-    void proc_rank (int g, int i, int comm);
+    void set_prio (int g, int i, int p);
+    /**
+     * Choose the maximum loop length of the pipes for the current tuning. This is fsamp / 6, which keeps
+     * the pitch of all pipes within 0.1 Hz, unless the predicted size of the wavetables exceeds WAVE_BUDGET:
+     * then it is reduced in steps, down to fsamp / 48, trading pitch accuracy of the bass pipes for memory.
+     */
+    void set_lmax ();
+    /**
+     * Predicted memory taken by the wavetables of all ranks, see Rankwave::wavesize
+     * @param lmax Maximum loop length
+     * @return The size in bytes
+     */
+    size_t wavesize (int lmax);
     /**
      * Set the on-off state of a user interface element. This is also triggers the actions
      * configured for the actions of switching on or off for the interface element (if any)
@@ -257,6 +315,28 @@ private:
      * @param g The interface groiup for which the user interface element should be switched off
      */
     void clr_group (int g);
+    /**
+     * The commands to the audio thread for switching an interface element on or off
+     * @param I The interface element
+     * @param s 0 for off, 1 for on
+     * @param a Output, room for 8 commands
+     * @return The number of commands
+     */
+    int  ifelm_comm (Ifelm *I, int s, uint32_t *a);
+    /**
+     * Set the state of interface elements in any groups at once. The commands of the elements
+     * that change are sent to the audio thread in batches (see send_batch), so that a preset
+     * is recalled within one period, with one update of the keys per division.
+     * @param bits The new state, per group as in get_state
+     * @param mask The elements to be set, per group
+     */
+    void set_ifelms (const uint32_t *bits, const uint32_t *mask);
+    /**
+     * Send commands to the audio thread as one batch, see AeolusAudio::proc_queue
+     * @param a The commands
+     * @param n The number of commands
+     */
+    void send_batch (const uint32_t *a, int n);
     /**
     * Set audio parameter
     * @param s Source id (to indicate source of change in user interface, not used at present)
@@ -272,7 +352,9 @@ private:
   * routing midi channels to all keyboards). <br />For setting the lower byte, which codes for the actual
   * midi-to-keyboard mapping, do not use mconf. Instead,
   * use AeolusAudio::setMidiMapBit, which in this implementation is called via the Android java AeolussynthManager.setMidiMapping
- * function and jni mapping in AeolusSynth_jni_functions-
+ * function and jni mapping in AeolusSynth_jni_functions-<br />
+ * Bits 8 to 11 of the upper byte are the division that receives the midi controllers of the channel, so all NDIVIS
+ * divisions can be addressed.
  * @param i Not used here, but transmitted to the user interface. Maybe this is intended to be a preset index??
  * @param d Pointer to beginning of 16 element array of type uint16, there need to be 16 elements in the underlying array
  */
@@ -299,7 +381,10 @@ private:
      */
     void midi_off (int mask);
     /**
-     * Change tuning to new base frequency and new temperament
+     * Change tuning to new base frequency and new temperament. With RETUNE_RATE, the existing wavetables
+     * are played at a different rate, which takes effect within a PERIOD, and they are regenerated
+     * afterwards only with RETUNE_REGEN. Otherwise all wavetables are regenerated. A retune is accepted
+     * while an earlier one is still generating, which then gets abandoned.
      * @param freq The new base frequency
      * @param temp The new selection of temperament
      */
@@ -373,6 +458,24 @@ private:
      * @return Success status: 0 on success, 1 on error
      */
     int  write_presets ();
+    /**
+     * Path of the preset file, in the user's home or in the instrument directory, see _uhome
+     * @param name Output, 1200 characters
+     */
+    void presetname (char *name);
+    /**
+     * Load the compiled instrument image instead of read_instr () and read_presets (). The image
+     * holds the definition, the synthesis parameters of all stops, the presets and the path of
+     * the wavetable bundle, and is read with one mapping of the file. It is only used if none of
+     * the files it was compiled from has changed since, by their modification time and size.
+     * @return Success status: 0 on success, 1 if there is no valid and current image
+     */
+    int  read_image ();
+    /**
+     * Compile the instrument image from the current configuration, see read_image
+     * @return Success status: 0 on success, 1 on error
+     */
+    int  write_image ();
 
     Lfq_u32        *_qcomm; // inter-process general message communication (model to audio thread)
     Lfq_u8         *_qmidi; // inter-process midi message communication (midi to audio thread)
@@ -381,6 +484,8 @@ private:
     const char     *_stops; // path to the directory holding the stops
     char            _instr [1024]; // path to the instrument definition and presets directory
     char            _waves [1024]; // path to the wavetable file storage location
+    char            _bundle [1024]; // path of the wavetable bundle of the instrument, see Wavebundle, empty if too long
+    char            _image [1024]; // path of the compiled instrument image, see read_image, empty if too long
     bool            _uhome; // use user's home?
     bool            _ready; // is everything loaded?
     bool            _isRetuning;  // true during the retuning process
@@ -397,6 +502,9 @@ private:
     float           _fbase; // Current base frequency for tuing
     int             _itemp; // The current temperament
     int             _count;
+    int             _nwait; // rank messages not yet returned by the audio thread
+    int             _nsync; // MT_AUDIO_SYNC messages not yet returned by the audio thread
+    int             _lmax; // maximum loop length of the pipes, see set_lmax
     int             _bank; // Current preset bank
     int             _pres; // Currently selected preset
     int             _client; // midi client for midi over IP, not used at present
@@ -22,159 +22,223 @@
 #include <cstdio>
 #include <cmath>
 #include <cstring>
+#include <ctime>
 #include <android/log.h>
 #include <sys/stat.h>
+#include <dirent.h>
+#include <utime.h>
+#include <unistd.h>
 #include "rankwave.h"
+#include "wavebundle.h"
+#include "wavekern.h"
+#include "wavepack.h"
+#include "waveresamp.h"
 
 #ifndef REPETITION_POINTS // sp
 # define REPETITION_POINTS 1
 #endif
 
+
 extern float exp2ap (float);
 
-Rngen   Pipewave::_rgen;
-float  *Pipewave::_arg = nullptr;
-float  *Pipewave::_att = nullptr;
+
+#if WAVE_RESAMPLE
+// Sample rates at which the bundle is searched for a rank that is missing at the current
+// rate, to be resampled, see Rankwave::loadalt. The canonical rate comes first.
+static const float altrates [] = { 48000.0f, 44100.0f, 96000.0f, 88200.0f };
+#endif
 
 
-void Pipewave::initstatic (float fsamp)
+wave_t *Pipewave::loop (wave_t *p, float *y, float dy, float *q, float g, float dg)
 {
-    int k;
+    int      k, m, n;
+    int32_t  a, d;
+    wave_t   *r;
+
+    // Fixed point read position and advance per sample, see wavekern.h. As in
+    // the former per-sample loop, the fraction is incremented before the first read.
+    d = (int32_t) lrintf ((step () + dy) * PH_ONE);
+    a = (int32_t) lrintf ((*y + dy) * PH_ONE);
+    r = p;
+    // A negative detune may take the first read before the loop start. The sample before it
+    // is the last one of the loop, which is read from the copy that follows it.
+    if ((a < 0) && (r == _p1)) r = _p2;
+    k = PERIOD;
+    g *= _scale;
+    dg *= _scale;
+    while (k)
+    {
+        // The loop is followed by _k_s * (PERIOD + 4) samples copied from its start,
+        // so the kernel may read past _p2 as long as r [j + 1] stays in this area.
+        // In the normal case the whole PERIOD is done in a single call.
+        m = (int)(_p2 - r) + _k_s * (PERIOD + 4) - 2;
+        n = (int)((((int64_t) m << PH_BITS) - a) / d) + 1;
+        if (n > k) n = k;
+        wavekern (r, a, d, q, n, g, dg);
+        a += n * d;
+        r += a >> PH_BITS;
+        a &= PH_MASK;
+        while (r >= _p2) r -= _l1;
+        q += n;
+        g -= n * dg;
+        k -= n;
+    }
 
-    if (_arg) return;
-    k = (int)(fsamp);
-    _arg = new float [k];
-    k = (int)(0.5f * fsamp);
-    _att = new float [k];
+    // The new position is computed in floating point from the initial one, so
+    // that the rounding of d does not accumulate from one period to the next.
+    return skip (p, y, dy);
 }
 
 
-void Pipewave::play ()
+wave_t *Pipewave::skip (wave_t *p, float *y, float dy)
 {
-    int     i, k;
-    float   g, dg, y, dy;
-    float   *p, *q, *r;
+    int    k;
+    float  t;
+
+    t = *y + PERIOD * dy;
+    k = (int) floorf (t);
+    *y = t - k;
+    p += PERIOD * _k_s / _k_d + k;
+    while (p >= _p2) p -= _l1; // loop over
+    if (p < _p1) p += _l1;
+    return p;
+}
 
-    p = _p_p; // copy of the _p_p play head pointer
-    r = _p_r; // copy of the _p_r release data pointer
 
-    if (_sdel & 1) // delayed state means we are playing the main note
+wave_t *Pipewave::attack (wave_t *p, float *y, float dy, float *q, float g, float dg)
+{
+    int      k, n;
+    int32_t  a, d;
+    int64_t  e;
+    float    s, t;
+
+    // Samples read from the attack, up to the last one that interpolates towards
+    // _p1 [0], which continues the attack as it is the time point following it.
+    d = (int32_t) lrintf (_ratio * PH_ONE);
+    a = (int32_t) lrintf (*y * PH_ONE);
+    k = (int)(_p1 - p);
+    e = ((int64_t) k << PH_BITS) - a;
+    e = (e > 0) ? (e + d - 1) / d : 0;
+    n = (e < PERIOD) ? (int) e : PERIOD;
+    wavekern (p, a, d, q, n, g * _scale, dg * _scale);
+    t = *y + n * _ratio;
+    if (n == PERIOD)
     {
-        if (! p) // We have no valid play pointer, start at the beginning of the wave table
-        {
-            p = _p0;
-            _y_p = 0.0f;
-            _z_p = 0.0f;
-        }
+        // Still in the attack. The pointer stays before _p1, so that the
+        // next call takes over the transition to the loop.
+        n = (int) floorf (t);
+        if (n > k - 1) n = k - 1;
+        *y = t - n;
+        return p + n;
     }
-    else
+    // The rest of the PERIOD from the loop, where one attack sample is step () table samples.
+    s = step ();
+    t = (t - k) * s;
+    a = (int32_t) lrintf (t * PH_ONE);
+    // The first read is at or past _p1, a negative a is only the rounding of t.
+    if (a < 0) a = 0;
+    d = (int32_t) lrintf ((s + dy) * PH_ONE);
+    wavekern (_p1, a, d, q + n, PERIOD - n, (g - n * dg) * _scale, dg * _scale);
+    // The position one sample step after the last one read, as loop () expects it.
+    t += (PERIOD - n - 1) * (s + dy) + s;
+    n = (int) floorf (t);
+    *y = t - n;
+    p = _p1 + n;
+    while (p >= _p2) p -= _l1;
+    return p;
+}
+
+
+void Pipewave::retune (float r)
+{
+    if (r < 0.667f) r = 0.667f;
+    if (r > 1.5f) r = 1.5f;
+    _ratio = r;
+    _d_t = (r - 1.0f) * step ();
+}
+
+
+// Sine and cosine of 2 pi x [i], for |x [i]| <= 0.5. Both are reduced to sin (2 pi u)
+// with |u| <= 0.25, computed by its Taylor polynomial of degree 11, which is exact to
+// about 6e-8. The loop is branch free, so it can be vectorized.
+static void sincos2pi (const float *x, float *s, float *c, int n)
+{
+    int    i;
+    float  a, u, v, y;
+
+    auto sin2pi = [] (float u)
     {
-        if (! r) // otherwise, we are releasing the note
-        {
-            r = p; // if we have no release pointer at this point, set to the current play pointer
-            p = nullptr; // not playing anymore
-            _g_r = 1.0f;
-            _y_r = _y_p;
-            _i_r = _k_r;
-        }
-    }
+        float t, y;
 
-    if (r) // Doing the release (this is an exponential to avoid a clack when suddenly stopping
+        t = 2 * (float) M_PI * u;
+        y = t * t;
+        return t * (1.0f - y / 6 * (1.0f - y / 20 * (1.0f - y / 42 * (1.0f - y / 72 * (1.0f - y / 110)))));
+    };
+
+    for (i = 0; i < n; i++)
     {
-        k = PERIOD;
-        q = _out;
-        g = _g_r;
-        i = _i_r - 1;
-        dg = g / PERIOD;
-        if (i) dg *= _m_r ;
+        y = x [i];
+        a = fabsf (y);
+        // sin (2 pi y) = sin (2 pi (0.5 - |y|)) * sign (y), cos (2 pi y) = sin (2 pi (0.25 - |y|))
+        u = (a > 0.25f) ? 0.5f - a : a;
+        v = 0.25f - a;
+        s [i] = copysignf (sin2pi (u), y);
+        c [i] = sin2pi (v);
+    }
+}
 
-        if (r < _p1) // release while still in attack phase
-        {
-            while (k--) // go on sampling with decreasing transfer gain
-            {
-                *q++ += g * *r++;
-                g -= dg;
-            }
-        }
-        else
-        {
-            y = _y_r;
-            dy = _d_r; // Go on sampling during release but at possible different rate
-            while (k--)
-            {
-                y += dy;
-                if (y > 1.0f)
-                {
-                    y -= 1.0f;
-                    r += 1;
-                }
-                else if (y < 0.0f)
-                {
-                    y += 1.0f;
-                    r -= 1;
-                }
-                *q++ += g * (r [0] + y * (r [1] - r [0]));
-                g -= dg;
-                r += _k_s;
-                if (r >= _p2) r -= _l1;
-            }
-            _y_r = y;
-        }
 
-        if (i)
-        {
-            _g_r = g;
-            _i_r = i;
-        }
-        else r = nullptr;
+// p [i] *= z [i], complex
+static void cmul (float *pr, float *pi, const float *zr, const float *zi, int n)
+{
+    int    i;
+    float  t;
+
+    for (i = 0; i < n; i++)
+    {
+        t = pr [i] * zr [i] - pi [i] * zi [i];
+        pi [i] = pr [i] * zi [i] + pi [i] * zr [i];
+        pr [i] = t;
     }
+}
+
+
+// p [i] *= z [i] as above, and w [i] += g [i] * imag (p [i])
+static void cmul (float *pr, float *pi, const float *zr, const float *zi, float *w, const float *g, int n)
+{
+    int    i;
+    float  t;
 
-    if (p) // We're playing
+    for (i = 0; i < n; i++)
     {
-        k = PERIOD;
-        q = _out;
-        if (p < _p1)
-        {
-            while (k--)
-            {
-                *q++ += *p++;
-            }
-        }
-        else
-        {
-            y = _y_p;
-            _z_p += _d_p * 0.0005f * (0.05f * _d_p * (_rgen.urandf () - 0.5f) - _z_p);
-            dy = _z_p * _k_s;
-            while (k--)
-            {
-                y += dy;
-                if (y > 1.0f)
-                {
-                    y -= 1.0f;
-                    p += 1;
-                }
-                else if (y < 0.0f)
-                {
-                    y += 1.0f;
-                    p -= 1;
-                }
-                *q++ += p [0] + y * (p [1] - p [0]); // interpolate and put into output
-                p += _k_s;
-                if (p >= _p2) p -= _l1; // loop over
-            }
-            _y_p = y;
-        }
+        t = pr [i] * zr [i] - pi [i] * zi [i];
+        pi [i] = pr [i] * zi [i] + pi [i] * zr [i];
+        pr [i] = t;
+        w [i] += g [i] * pi [i];
     }
+}
 
-    _p_p = p; // For the next round
-    _p_r = r; // for the next round
+
+// The same with a constant gain.
+static void cmul (float *pr, float *pi, const float *zr, const float *zi, float *w, float g, int n)
+{
+    int    i;
+    float  t;
+
+    for (i = 0; i < n; i++)
+    {
+        t = pr [i] * zr [i] - pi [i] * zi [i];
+        pi [i] = pr [i] * zi [i] + pi [i] * zr [i];
+        pr [i] = t;
+        w [i] += g * pi [i];
+    }
 }
 
 
-void Pipewave::genwave (Addsynth *D, int n, float fsamp, float fpipe)
+int Pipewave::genlen (Addsynth *D, int n, float fsamp, float f1, int lmax, int *nc)
 {
-    int    h, i, k, nc;
-    float  f0, f1, f, m, t, v, v0;
+    int    h, k;
+    float  m, t;
 
     m = D->_n_att.vi (n); // m is maximum attack duration in seconds
     for (h = 0; h < N_HARM; h++)
@@ -188,57 +252,55 @@ void Pipewave::genwave (Addsynth *D, int n, float fsamp, float fpipe)
     _l0 = (int)(fsamp * m + 0.5); // _l0 is maximum attack duration in samples
     _l0 = (_l0 + PERIOD - 1) & ~(PERIOD - 1); // rounded up to an integer number of PERIODs (if PERIOD is a power of 2)
 
-    f1 = (fpipe + D->_n_off.vi (n) + D->_n_ran.vi (n) * (2 * _rgen.urand () - 1)) / fsamp; // f1 is effective pipe frequency in terms of sampling rate
-    f0 = f1 * exp2ap (D->_n_atd.vi (n) / 1200.0f); // f0 is detuned pipe frequency during attack
-
-    // Find the highest harmonic satisfying the Nyquist criterion (relative
-    // frequencey < 0.5 and off reasonable intensity (-40dB).
-    for (h = N_HARM - 1; h >= 0; h--)
-    {
-        f = (h + 1) * f1;
-        if ((f < 0.45f) && (D->_h_lev.vi (h, n) >= -40.0f)) break;
-    }
-    // f is frequency of highest relevant harmonics in terms of sampling rate
-    if      (f > 0.250f) _k_s = 3; // choose sample step according to required
-    else if (f > 0.125f) _k_s = 2; // temporal resolution
-    else                 _k_s = 1;
+    // choose the table rate of the loop according to the required temporal resolution
+    looprate (D, n, f1, &_k_s, &_k_d);
     // The length of the main loop is selected such that it:
     // A) Represents an integral number of sinusoidal oscillation cylces; nc is the number of cycles
-    // B) At the same, when sampled at the sampling frequency (or a multiple of it), defines the
+    // B) At the same, when sampled at the table rate (a multiple or fraction of the sampling frequency), defines the
     //    pipe frequency as closely as possible to the actual target pipe frequency, meaning that
     //    both nc and l1 are optimized integer numbers such that
     //    f is approximated by fsamp/l1*nc. Due to the constraint that nc and l1 should be integers, this
     //    is not quite trivial, see the documentation of the looplen function for details of how these
     //    numbers are selected.
-    looplen (f1 * fsamp, _k_s * fsamp, (int)(fsamp / 6.0f), &_l1, &nc);
-    // round up _l1 to the nearest multiple of (_k_s * PERIOD)
-    if (_l1 < _k_s * PERIOD)
+    looplen (f1 * fsamp, _k_s * fsamp / _k_d, lmax, &_l1, nc);
+    // the loop must be at least as long as the advance in one PERIOD
+    k = PERIOD * _k_s / _k_d;
+    if (_l1 < k)
     {
-        k = (_k_s * PERIOD - 1) / _l1 + 1;
+        k = (k - 1) / _l1 + 1;
         _l1 *= k;
-        nc *= k;
+        *nc *= k;
     }
+    return size ();
+}
+
+
+void Pipewave::genwave (Addsynth *D, int n, float fsamp, float fpipe, int lmax)
+{
+    int    h, i, k, l, nc;
+    float  f0, f1, t, v, v0;
+    float  *w, *arg, *att, *zr, *zi, *pr, *pi;
+    Rngen  R;
+
+    R.init ((uint32_t)(_key ^ (_key >> 32)) | 1);
+
+    f1 = (fpipe + D->_n_off.vi (n) + D->_n_ran.vi (n) * (2 * R.urand () - 1)) / fsamp; // f1 is effective pipe frequency in terms of sampling rate
+    f0 = f1 * exp2ap (D->_n_atd.vi (n) / 1200.0f); // f0 is detuned pipe frequency during attack
 
     // k is the number of samples to allocate
-    k = _l0 + _l1 + _k_s * (PERIOD + 4);
+    k = genlen (D, n, fsamp, f1, lmax, &nc);
 
-    delete[] _p0; // delete formerly present data
-    _p0 = new float [k];
-    _p1 = _p0 + _l0; // accessory data pointer: mark begin of loop
-    _p2 = _p1 + _l1; // accessory data pointer: mark end of loop
-    memset (_p0, 0, k * sizeof (float));
+    // The samples are computed in floating point, and converted by store () at the end.
+    w = new float [k];
+    memset (w, 0, k * sizeof (float));
+    // Time in cycles and attack gain, local so that several pipes can be generated at once.
+    arg = new float [_l0 + _l1 + 1];
+    att = new float [_l0 + 1];
 
-    // _k_r is release duration in PERIODs
-    _k_r = (int)(ceilf (D->_n_dct.vi (n) * fsamp / PERIOD) + 1);
-    // _m_r is multiplier to apply for each PERIOD
-    _m_r = 1.0f - powf (0.1, 1.0 / _k_r);
-    // _d_r is release detune scaled to _k_s
-    _d_r = _k_s * (exp2ap (D->_n_dcd.vi (n) / 1200.0f) - 1.0f);
-    // _d_p is instability
-    _d_p = D->_n_ins.vi (n);
+    genrel (D, n, fsamp);
 
-    // use _arg as a buffer for time progress
-    // _arg contains time in cycles
+    // use arg as a buffer for time progress
+    // arg contains time in cycles
     t = 0.0f;
     // during attack, interpolate between detuned and nominal
     // frequency such that nominal frequency is reached at the
@@ -246,15 +308,31 @@ void Pipewave::genwave (Addsynth *D, int n, float fsamp, float fpipe)
     k = (int)(fsamp * D->_n_att.vi (n) + 0.5);
     for (i = 0; i <= _l0; i++)
     {
-        _arg [i] = t - floorf (t + 0.5);
+        arg [i] = t - floorf (t + 0.5);
         t += (i < k) ? (((k - i) * f0 + i * f1) / k) : f1;
     }
-    // during loop,  fill _arg with the progressing
+    // during loop,  fill arg with the progressing
     // cycle number
     for (i = 1; i < _l1; i++)
     {
-        t = _arg [_l0]+ (float) i * nc / _l1;
-        _arg [i + _l0] = t - floorf (t + 0.5);
+        t = arg [_l0]+ (float) i * nc / _l1;
+        arg [i + _l0] = t - floorf (t + 0.5);
+    }
+    // Instead of a sinf () per harmonic and sample, the fundamental is computed once
+    // per sample as the unit vector z = exp (2 pi j arg), and the harmonics as its
+    // powers p = z^(h+1), by one complex multiplication per harmonic and sample.
+    // In float, the error of z^64 is a few 1e-6, well below that of the former
+    // float phase argument, and the loops below have no dependency between samples.
+    l = _l0 + _l1;
+    zr = new float [4 * l];
+    zi = zr + l;
+    pr = zi + l;
+    pi = pr + l;
+    sincos2pi (arg, zi, zr, l);
+    for (i = 0; i < l; i++)
+    {
+        pr [i] = 1.0f;
+        pi [i] = 0.0f;
     }
     // exp2ap(x) is a fast approximation of 2^x
     // 0.1661 is the factor to convert from dB to powers of 2
@@ -266,26 +344,183 @@ void Pipewave::genwave (Addsynth *D, int n, float fsamp, float fpipe)
         if ((h + 1) * f1 > 0.45) break;
         // here, v is the harmonic's level in dB
         v = D->_h_lev.vi (h, n);
-        if (v < -80.0) continue;
+        if (v < -80.0)
+        {
+            // p = z^(h+1), the harmonic is not used
+            cmul (pr, pi, zr, zi, l);
+            continue;
+        }
         // here, v is the harmonic's final amplitude after applying random variation
-        v = v0 * exp2ap (0.1661 * (v + D->_h_ran.vi (h, n) * (2 * _rgen.urand () - 1)));
+        v = v0 * exp2ap (0.1661 * (v + D->_h_ran.vi (h, n) * (2 * R.urand () - 1)));
         // k is the harmonic's attack duration in samples
         k = (int)(fsamp * D->_h_att.vi (h, n) + 0.5);
         // attgain() computes the harmonic's attack gain over
-        // the attack period and stores it in the _att array
-        attgain (k, D->_h_atp.vi (h, n));
-        // compute the harmonic's contribution to attack and loop samples
-        for (i = 0; i < _l0 + _l1; i++)
+        // the attack period and stores it in the att array
+        attgain (att, k, D->_h_atp.vi (h, n));
+        // p = z^(h+1), and its contribution to attack and loop samples,
+        // with the attack gain for the first k of them
+        if (k > l) k = l;
+        for (i = 0; i < k; i++) att [i] *= v;
+        cmul (pr, pi, zr, zi, w, att, k);
+        cmul (pr + k, pi + k, zr + k, zi + k, w + k, v, l - k);
+    }
+    delete[] zr;
+    // fill remaining samples at the end with data from the loop
+    for (i = 0; i < _k_s * (PERIOD + 4); i++) w [i + _l0 + _l1] = w [i + _l0];
+    store (w);
+    delete[] w;
+    delete[] arg;
+    delete[] att;
+}
+
+
+void Pipewave::genrel (Addsynth *D, int n, float fsamp)
+{
+    // _k_r is release duration in PERIODs
+    _k_r = (int)(ceilf (D->_n_dct.vi (n) * fsamp / PERIOD) + 1);
+    // _m_r is multiplier to apply for each PERIOD
+    _m_r = 1.0f - powf (0.1, 1.0 / _k_r);
+    // _d_r is release detune scaled to the sample step
+    _d_r = step () * (exp2ap (D->_n_dcd.vi (n) / 1200.0f) - 1.0f);
+    // _d_p is instability
+    _d_p = D->_n_ins.vi (n);
+}
+
+
+void Pipewave::store (const float *w)
+{
+    int      k;
+    Wavetab  *T;
+
+    k = size ();
+    T = newtab (k);
+#if WAVE16
+    int    i;
+    float  v;
+
+    // Scale the peak of the whole table, attack included, to full range.
+    v = 0.0f;
+    for (i = 0; i < k; i++) if (fabsf (w [i]) > v) v = fabsf (w [i]);
+    T->_scale = (v > 0.0f) ? v / 32767.0f : 1.0f;
+    v = 1.0f / T->_scale;
+    for (i = 0; i < k; i++) T->_p0 [i] = (int16_t) lrintf (v * w [i]);
+#else
+    T->_scale = 1.0f;
+    memcpy (T->_p0, w, k * sizeof (float));
+#endif
+    T->setpeak ();
+    attach (Wavetab::insert (T));
+}
+
+
+Wavetab *Pipewave::newtab (int k, Wavemap *M, size_t offs)
+{
+    Wavetab *T;
+
+    T = M ? new Wavetab (_key, M, offs) : new Wavetab (_key, k);
+    T->_l0  = _l0;
+    T->_l1  = _l1;
+    T->_k_s = _k_s;
+    T->_k_d = _k_d;
+    T->_k_r = _k_r;
+    T->_m_r = _m_r;
+    T->_d_r = _d_r;
+    T->_d_p = _d_p;
+    return T;
+}
+
+
+void Pipewave::attach (Wavetab *T)
+{
+    if (_tab) _tab->release ();
+    _tab   = T;
+    _l0    = T->_l0;
+    _l1    = T->_l1;
+    _k_s   = T->_k_s;
+    _k_d   = T->_k_d;
+    _k_r   = T->_k_r;
+    _m_r   = T->_m_r;
+    _d_r   = T->_d_r;
+    _d_p   = T->_d_p;
+    _scale = T->_scale;
+    _peak  = T->_peak;
+    _p0 = T->_p0;
+    _p1 = _p0 + _l0; // accessory data pointer: mark begin of loop
+    _p2 = _p1 + _l1; // accessory data pointer: mark end of loop
+    // Publish the descriptor to the audio thread.
+    _ready.store (true, std::memory_order_release);
+}
+
+
+void Pipewave::looprate (Addsynth *D, int n, float f1, int16_t *k_s, int16_t *k_d)
+{
+    int    h;
+    float  f, g;
+
+    // Find the highest harmonic satisfying the Nyquist criterion (relative
+    // frequencey < 0.5 and off reasonable intensity (-40dB), and the highest
+    // one that genwave computes at all.
+    f = g = 0.0f;
+    for (h = N_HARM - 1; h >= 0; h--)
+    {
+        f = (h + 1) * f1;
+        if (f > 0.45f) continue;
+        if ((g == 0.0f) && (D->_h_lev.vi (h, n) >= -80.0f)) g = f;
+        if ((f < 0.45f) && (D->_h_lev.vi (h, n) >= -40.0f)) break;
+    }
+    // f is frequency of highest relevant harmonics in terms of sampling rate
+    if (h < 0) f = f1;
+    if (g < f) g = f;
+    *k_s = 1;
+    *k_d = 1;
+    if      (f > 0.250f) *k_s = 3; // oversampled loop
+    else if (f > 0.125f) *k_s = 2;
+    else if ((4 * f <= 0.125f) && (4 * g < 0.45f)) *k_d = 4; // reduced rate loop
+    else if ((2 * f <= 0.125f) && (2 * g < 0.45f)) *k_d = 2;
+}
+
+
+uint64_t Pipewave::genkey (Addsynth *D, int n, float fsamp, float fpipe, int lmax)
+{
+    int       h, i;
+    uint64_t  k;
+    float     v [12];
+
+    // FNV-1a over the bytes of the parameter values.
+    auto hash = [&k] (const void *p, int n)
+    {
+        const unsigned char *b = (const unsigned char *) p;
+        while (n--)
         {
-            t = _arg [i] * (h + 1);
-            t -= floorf (t);
-            m = v * sinf (2 * M_PI * t);
-            if (i < k) m *= _att [i]; // apply attack gain
-            _p0 [i] += m;
+            k ^= *b++;
+            k *= 0x100000001b3ULL;
         }
+    };
+
+    k = 0xcbf29ce484222325ULL;
+    i = WAVE16;
+    hash (&i, sizeof (i));
+    hash (&lmax, sizeof (lmax));
+    v [0] = fsamp;
+    v [1] = fpipe;
+    v [2] = D->_n_vol.vi (n);
+    v [3] = D->_n_off.vi (n);
+    v [4] = D->_n_ran.vi (n);
+    v [5] = D->_n_ins.vi (n);
+    v [6] = D->_n_att.vi (n);
+    v [7] = D->_n_atd.vi (n);
+    v [8] = D->_n_dct.vi (n);
+    v [9] = D->_n_dcd.vi (n);
+    hash (v, 10 * sizeof (float));
+    for (h = 0; h < N_HARM; h++)
+    {
+        v [0] = D->_h_lev.vi (h, n);
+        v [1] = D->_h_ran.vi (h, n);
+        v [2] = D->_h_att.vi (h, n);
+        v [3] = D->_h_atp.vi (h, n);
+        hash (v, 4 * sizeof (float));
     }
-    // fill remaining samples at the end with data from the loop
-    for (i = 0; i < _k_s * (PERIOD + 4); i++) _p0 [i + _l0 + _l1] = _p0 [i + _l0];
+    return k;
 }
 
 
@@ -326,6 +561,7 @@ void Pipewave::looplen (float f, float fsamp, int lmax, int *aa, int *bb)
         else
         {
             b = (int)(lmax * f / fsamp);
+            if (b < 1) b = 1; // a single cycle may be longer than lmax
             a = (int)(b * fsamp / f + 0.5);
             d = fsamp * b / a - f;
             break;
@@ -336,7 +572,7 @@ void Pipewave::looplen (float f, float fsamp, int lmax, int *aa, int *bb)
 }
 
 
-void Pipewave::attgain (int n, float p)
+void Pipewave::attgain (float *att, int n, float p)
 {
     int    i, j, k;
     float  d, m, w, x, y, z;
@@ -356,74 +592,370 @@ void Pipewave::attgain (int n, float p)
         while (j < k)
         {
             m = (double) j / n;
-            _att [j++] = (1.0 - m) * z + m;
+            att [j++] = (1.0 - m) * z + m;
             z += d;
         }
     }
 }
 
 
-void Pipewave::save (FILE *F)
+// The descriptor of a pipe in the wavetable file, 32 bytes.
+union Pipedesc
 {
-    int  k;
-    union
-    {
-        int16_t i16 [16];
-        int32_t i32 [8];
-        float   flt [8];
-    } d;
+    int16_t i16 [16];
+    int32_t i32 [8];
+    float   flt [8];
+};
+
 
+void Pipewave::getdesc (void *p, float g) const
+{
+    Pipedesc  d;
+
+    memset (&d, 0, sizeof (d));
     d.i32 [0] = _l0;
     d.i32 [1] = _l1;
     d.i16 [4] = _k_s;
     d.i16 [5] = _k_r;
     d.flt [3] = _m_r;
-    d.i32 [4] = 0;
-    d.i32 [5] = 0;
-    d.i32 [6] = 0;
-    d.i32 [7] = 0;
-    fwrite (&d, 1, 32, F);
-    k = _l0 +_l1 + _k_s * (PERIOD + 4);
-    fwrite (_p0, k, sizeof (float), F);
+    d.i16 [8] = (g > 0) ? 2 : (WAVE16 ? 1 : 0); // sample format, 0 = float, 1 = 16 bit, 2 = compressed
+    d.i16 [9] = _k_d;
+    d.flt [5] = (g > 0) ? g : _scale;
+    d.flt [6] = _d_r;
+    d.flt [7] = _d_p;
+    memcpy (p, &d, sizeof (d));
 }
 
 
-void Pipewave::load (FILE *F)
+int Pipewave::setdesc (const void *p)
 {
-    int  k;
-    union
-    {
-        int16_t i16 [16];
-        int32_t i32 [8];
-        float   flt [8];
-    } d;
+    Pipedesc  d;
 
-    fread (&d, 1, 32, F);
+    memcpy (&d, p, sizeof (d));
     _l0  = d.i32 [0];
     _l1  = d.i32 [1];
     _k_s = d.i16 [4];
     _k_r = d.i16 [5];
     _m_r = d.flt [3];
-    k = _l0 +_l1 + _k_s * (PERIOD + 4);
-    delete[] _p0;
-    _p0 = new float [k];
-    _p1 = _p0 + _l0;
-    _p2 = _p1 + _l1;
-    fread (_p0, k, sizeof (float), F);
+    // Files written before the reduced rate loops have a zero here.
+    _k_d = d.i16 [9] ? d.i16 [9] : 1;
+    // Files written before the 16 bit format have zeros in the format, scale
+    // and detune fields. As before, such tables are played without detune.
+    _scale = d.flt [5];
+    _d_r = d.flt [6];
+    _d_p = d.flt [7];
+    if ((d.i16 [8] < 0) || (d.i16 [8] > 2)) return -1;
+    if ((_k_d != 1) && (_k_d != 2) && (_k_d != 4)) return -1;
+    if ((_l0 < 0) || (_l1 < 0) || (_k_s < 0)) return -1;
+    return d.i16 [8];
 }
 
 
+int Pipewave::load (FILE *F)
+{
+    int      f, k;
+    Wavetab  *T;
+    char     d [32];
+
+    if (fread (d, 1, 32, F) != 32) return 1;
+    if (((f = setdesc (d)) < 0) || (f == 2)) return 1;
+    k = size ();
+    if ((T = Wavetab::find (_key)))
+    {
+        // Already in memory for another rank.
+        attach (T);
+        return fseek (F, k * (f ? sizeof (int16_t) : sizeof (float)), SEEK_CUR) ? 1 : 0;
+    }
+    if (f == (WAVE16 ? 1 : 0))
+    {
+        T = newtab (k);
+        T->_scale = WAVE16 ? _scale : 1.0f;
+        if (fread (T->_p0, sizeof (wave_t), k, F) != (size_t) k)
+        {
+            T->release ();
+            return 1;
+        }
+        T->setpeak ();
+        attach (Wavetab::insert (T));
+    }
+    else
+    {
+        char *v = new char [k * (f ? sizeof (int16_t) : sizeof (float))];
+        if (fread (v, f ? sizeof (int16_t) : sizeof (float), k, F) != (size_t) k) k = -1;
+        else convert (v, f, k);
+        delete[] v;
+        if (k < 0) return 1;
+    }
+    return 0;
+}
+
+
+int Pipewave::load (Wavemap *M, const char *d, size_t base, size_t end)
+{
+    int      f, k;
+    int32_t  n;
+    int64_t  offs;
+    Wavetab  *T;
+
+    if ((f = setdesc (d)) < 0) return 1;
+    k = size ();
+    memcpy (&offs, d + 32, sizeof (offs));
+    if (f == 2) memcpy (&n, d + 44, sizeof (n));
+    else n = k * (f ? sizeof (int16_t) : sizeof (float));
+    if ((offs < 0) || (offs & 63) || (n < 0) || (base + offs + n > end)) return 1;
+    offs += base;
+    if ((T = Wavetab::find (_key)))
+    {
+        // Already in memory for another rank.
+        attach (T);
+        return 0;
+    }
+    if (f == 2) return 2;
+    if (f == (WAVE16 ? 1 : 0))
+    {
+        // The samples stay in the file, and are only read when the pipe is played.
+        T = newtab (k, M, offs);
+        T->_scale = WAVE16 ? _scale : 1.0f;
+        memcpy (&T->_peak, d + 40, sizeof (float));
+        attach (Wavetab::insert (T));
+    }
+    else convert (M->data () + offs, f, k);
+    return 0;
+}
+
+
+void Pipewave::convert (const void *p, int f, int k)
+{
+    int    i;
+    float  *w;
+
+    w = new float [k];
+    if (f)
+    {
+        // 16 bit samples, convert to float.
+        const int16_t *v = (const int16_t *) p;
+        for (i = 0; i < k; i++) w [i] = _scale * v [i];
+    }
+    else
+    {
+        // Float samples, convert to 16 bit.
+        memcpy (w, p, k * sizeof (float));
+    }
+    store (w);
+    delete[] w;
+}
+
+
+uint8_t *Pipewave::pack (int b, size_t *n, float *g) const
+{
+    int       i, k, m;
+    int32_t  *x;
+    uint8_t  *p;
+
+    k = size ();
+    m = (1 << (b - 1)) - 1;
+    x = new int32_t [k];
+#if WAVE16
+    int  s;
+
+    // The samples use the full 16 bit range, see store ().
+    s = (b < 16) ? 16 - b : 0;
+    for (i = 0; i < k; i++)
+    {
+        x [i] = s ? (_p0 [i] + (1 << (s - 1))) >> s : _p0 [i];
+        if (x [i] > m) x [i] = m;
+    }
+    *g = ldexpf (_scale, s);
+#else
+    float  v;
+
+    v = 0.0f;
+    for (i = 0; i < k; i++) if (fabsf (_p0 [i]) > v) v = fabsf (_p0 [i]);
+    *g = (v > 0.0f) ? v / m : 1.0f;
+    v = 1.0f / *g;
+    for (i = 0; i < k; i++) x [i] = lrintf (v * _p0 [i]);
+#endif
+    p = new uint8_t [wavepack_max (k)];
+    *n = wavepack (x, k, p);
+    delete[] x;
+    return p;
+}
+
+
+int Pipewave::unpack (const char *d, const char *p)
+{
+    int      k, e;
+    int32_t  n, b;
+    int64_t  offs;
+    Wavetab  *T;
+
+    memcpy (&offs, d + 32, sizeof (offs));
+    memcpy (&n, d + 44, sizeof (n));
+    memcpy (&b, d + 48, sizeof (b));
+    if ((b < 8) || (b > 24)) return 1;
+    k = size ();
+    T = newtab (k);
+#if WAVE16
+    // Samples of more than 16 bits are rounded.
+    e = waveunpack ((const uint8_t *)(p + offs), n, T->_p0, k, b - 16);
+    T->_scale = (b > 16) ? ldexpf (_scale, b - 16) : _scale;
+#else
+    e = waveunpack ((const uint8_t *)(p + offs), n, T->_p0, k, _scale);
+    T->_scale = 1.0f;
+#endif
+    if (e)
+    {
+        T->release ();
+        return 1;
+    }
+    memcpy (&T->_peak, d + 40, sizeof (float));
+    attach (Wavetab::insert (T));
+    return 0;
+}
+
+
+int Pipewave::reslen (const Pipewave *S, Addsynth *D, int n, float fs1, float fs2, float fpipe, int lmax)
+{
+    int     k, l, m, b;
+    double  q, e, d;
+
+    // The attack takes at least the same time, rounded up to PERIODs, see resample ().
+    _l0 = (int) ceil ((double) S->_l0 * fs2 / fs1 - 1e-6);
+    _l0 = (_l0 + PERIOD - 1) & ~(PERIOD - 1);
+    // The loop rate is chosen for the new sampling frequency. The loop holds as many loops of S
+    // as make the rounding of its length to an integer, which is its pitch error, the smallest
+    // within lmax, and at least as many as it takes to be as long as the advance in one PERIOD.
+    looprate (D, n, fpipe / fs2, &_k_s, &_k_d);
+    q = (double) fs2 * _k_s / _k_d / (fs1 * S->step ());
+    k = PERIOD * _k_s / _k_d;
+    _l1 = 0;
+    b = 1;
+    d = 0;
+    for (m = 1; ; m++)
+    {
+        e = m * S->_l1 * q;
+        l = (int)(e + 0.5);
+        if (_l1 && ((l > lmax) || (d < 1e-9))) break;
+        if ((l >= k) && (! _l1 || (fabs (l - e) < d * e)))
+        {
+            _l1 = l;
+            b = m;
+            d = fabs (l - e) / e;
+        }
+    }
+    genrel (D, n, fs2);
+    return b;
+}
+
+
+void Pipewave::resample (const Pipewave *S, int m, float r, const Waveresamp *A, const Waveresamp *L)
+{
+    int     i, j, k, h;
+    float   *w, *x, u, v;
+    double  p;
+
+    auto src = [S] (int i) { return S->_scale * S->_p0 [i]; };
+
+    w = new float [size ()];
+    k = S->_l1;
+    // The attack, from the same start. It is longer than that of S by less than a PERIOD, and
+    // runs on into the loop of S, read as play () does at the sample rate of the attack.
+    h = A->pad ();
+    j = (int) ceil (_l0 / (double) r) + h + 1;
+    x = new float [j + h + 1];
+    for (i = -h; i <= j; i++)
+    {
+        if (i < 0) v = 0.0f;
+        else if (i < S->_l0) v = src (i);
+        else
+        {
+            p = (i - S->_l0) * (double) S->step ();
+            u = (float)(p - floor (p));
+            v = src (S->_l0 + (int) p % k);
+            v += u * (src (S->_l0 + ((int) p + 1) % k) - v);
+        }
+        x [i + h] = v;
+    }
+    A->run (x, h, 1.0 / r, w, _l0);
+    delete[] x;
+    // The loop: m loops of S fitted into _l1 samples, from the position in the loop of S where
+    // the attack ends. S is read cyclically, so that the new loop closes as smoothly as the one
+    // of S, and continues the attack as it would have.
+    p = fmod ((_l0 / (double) r - S->_l0) * S->step (), k);
+    h = L->pad ();
+    x = new float [(m + 1) * k + 2 * h + 1];
+    for (i = -h; i <= (m + 1) * k + h; i++) x [i + h] = src (S->_l0 + ((i % k) + k) % k);
+    L->run (x, h + p, (double) m * k / _l1, w + _l0, _l1);
+    delete[] x;
+    // fill remaining samples at the end with data from the loop
+    for (i = 0; i < _k_s * (PERIOD + 4); i++) w [i + _l0 + _l1] = w [i + _l0];
+    store (w);
+    delete[] w;
+}
+
+
+
+
+// Pending generation of a rank, see Rankwave::gen_init.
+struct Genjob
+{
+    Rankwave   *W;
+    Addsynth   *D;
+    float       fsamp;
+    int         lmax;  // maximum loop length
+    float      *fp;    // pipe frequencies
+    int        *ord;   // pipe indices in generation order, middle of the compass first
+    int        *sel;   // pipe indices of the current gen_some () call
+    bool       *done;  // pipe taken by gen_some ()
+    int         k;     // next index in ord
+    int         n;     // pipes left
+
+    ~Genjob ()
+    {
+        delete[] fp;
+        delete[] ord;
+        delete[] sel;
+        delete[] done;
+    }
+};
+
+
+// Compressed pipes of a rank being loaded, see Rankwave::loadmap.
+struct Unpackjob
+{
+    Pipewave           *P;    // pipes of the rank
+    const char         *d;    // the image in the mapping
+    int                *sel;  // pipe indices to unpack
+    std::atomic<int>    err;  // set if a pipe fails
+};
+
+
+// Pipes of a rank being resampled from another sample rate, see Rankwave::resample.
+struct Resamplejob
+{
+    Pipewave           *P;    // pipes of the rank
+    Pipewave           *S;    // the same pipes at the other rate
+    int                *sel;  // pipe indices to resample
+    int                *rep;  // loops of S in the new loop of each pipe, see Pipewave::reslen
+    Waveresamp        **L;    // loop filter of each pipe
+    Waveresamp         *A;    // attack filter
+    float               r;    // ratio of the new and the old sampling frequency
+};
 
 
-Rankwave::Rankwave (int n0, int n1) : _n0 (n0), _n1 (n1), _list (nullptr), _modif (false)
+Rankwave::Rankwave (int n0, int n1) : _n0 (n0), _n1 (n1), _voices (nullptr), _index (0), _modif (false), _fbase (0), _job (nullptr), _oldfile (nullptr)
 {
     _pipes = new Pipewave [n1 - n0 + 1];
+    for (int i = 0; i < 12; i++) _scale [i] = 1.0f;
 }
 
 
 Rankwave::~Rankwave ()
 {
+    detach ();
+    delete _job;
     delete[] _pipes;
+    delete[] _oldfile;
 }
 
 
@@ -488,82 +1020,208 @@ namespace
 
 
 
-void Rankwave::gen_waves (Addsynth *D, float fsamp, float fbase, float *scale)
+void Rankwave::fpipes (Addsynth *D, float fbase, float *scale, float *fp)
 {
-    Pipewave::initstatic (fsamp);
-    __android_log_print(android_LogPriority::ANDROID_LOG_INFO,
-                        "Pipewave::genwave", "Generating wave samping frequency %f",fsamp);
-
-
 #if REPETITION_POINTS
-    float fn = D->_fn, fd = D->_fd,
-            fbase_adj = fbase * D->_fn / (D->_fd * scale[9]);
+    // The repetitions only change local copies of the frequency multiplier, as this may be
+    // called by the model and the slave thread at the same time for the same stop.
+    int32_t fn = D->_fn, fd = D->_fd;
+    float fbase_adj = fbase * fn / (fd * scale[9]);
     RepetitionPoint* points = ParseRepetitions( D->_comments ), *p = points;
     for (int i = _n0; i <= _n1; i++)
     {
         if( p && i == p->note )
         {
             fbase_adj = 0;
-            D->_fn = p->den * 8;
-            D->_fd = p->num;
-            if( D->_fn > 0 && D->_fd > 0 )
-                fbase_adj = fbase * D->_fn / (D->_fd * scale[9]);
+            fn = p->den * 8;
+            fd = p->num;
+            if( fn > 0 && fd > 0 )
+                fbase_adj = fbase * fn / (fd * scale[9]);
             p = p->next;
         }
-        if( fbase_adj > 0 )
-            _pipes [i - _n0].genwave (D, i - _n0, fsamp, ldexpf (fbase_adj * scale [i % 12], i / 12 - 5));
+        fp [i - _n0] = ( fbase_adj > 0 ) ? ldexpf (fbase_adj * scale [i % 12], i / 12 - 5) : 0;
     }
     delete points;
-    D->_fn = fn;
-    D->_fd = fd;
 #else
     fbase *=  D->_fn / (D->_fd * scale [9]);
     for (int i = _n0; i <= _n1; i++)
     {
-	_pipes [i - _n0].genwave (D, i - _n0, fsamp, ldexpf (fbase * scale [i % 12], i / 12 - 5));
+	fp [i - _n0] = ldexpf (fbase * scale [i % 12], i / 12 - 5);
     }
 #endif // REPETITION_POINTS
+}
+
+
+void Rankwave::gen_pipe (void *arg, int n)
+{
+    Genjob    *J = (Genjob *) arg;
+    Pipewave  *P;
+    Wavetab   *T;
+
+    n = J->sel [n];
+    if (J->fp [n] <= 0) return;
+    P = J->W->_pipes + n;
+    // Identical pipes of other ranks share their wavetable.
+    P->_key = Pipewave::genkey (J->D, n, J->fsamp, J->fp [n], J->lmax);
+    if ((T = Wavetab::find (P->_key))) P->attach (T);
+    else P->genwave (J->D, n, J->fsamp, J->fp [n], J->lmax);
+}
+
+
+void Rankwave::gen_waves (Addsynth *D, float fsamp, float fbase, float *scale, int lmax, Genpool *pool)
+{
+    gen_init (D, fsamp, fbase, scale, lmax);
+    while (gen_some (pool, _n1 - _n0 + 1));
+}
+
+
+void Rankwave::gen_init (Addsynth *D, float fsamp, float fbase, float *scale, int lmax)
+{
+    int       i, n;
+    Genjob    *J;
+
+    __android_log_print(android_LogPriority::ANDROID_LOG_INFO,
+                        "Pipewave::genwave", "Generating wave samping frequency %f",fsamp);
+
+    n = _n1 - _n0 + 1;
+    delete _job;
+    _job = J = new Genjob;
+    J->W = this;
+    J->D = D;
+    J->fsamp = fsamp;
+    J->lmax = lmax;
+    J->fp = new float [n];
+    J->ord = new int [n];
+    J->sel = new int [n];
+    J->done = new bool [n];
+    J->k = 0;
+    J->n = n;
+    fpipes (D, fbase, scale, J->fp);
+    // From the middle of the compass outwards, alternating up and down.
+    for (i = 0; i < n; i++)
+    {
+        J->ord [i] = (n - 1) / 2 + ((i & 1) ? (i + 1) / 2 : -(i / 2));
+        J->done [i] = false;
+        _pipes [i]._ready.store (false, std::memory_order_relaxed);
+        _pipes [i]._want.store (false, std::memory_order_relaxed);
+    }
+    _fbase = fbase;
+    memcpy (_scale, scale, 12 * sizeof (float));
     _modif = true;
 }
 
 
-void Rankwave::set_param (float *out, int del, int pan)
+int Rankwave::gen_some (Genpool *pool, int n)
 {
-    int         n, a, b;
-    Pipewave   *P;
+    int       i, j, m;
+    Genjob    *J = _job;
 
-    _sbit = 1 << del;
-    switch (pan)
+    if (! J) return 0;
+    m = 0;
+    // Keyed pipes first. The flag is only a hint, so it is read without ordering.
+    for (i = 0; (i <= _n1 - _n0) && (m < n); i++)
     {
-        case 'L': a = 2, b = 0; break;
-        case 'C': a = 2, b = 1; break;
-        case 'R': a = 2, b = 2; break;
-        default:  a = 4, b = 0;
+        if (! J->done [i] && _pipes [i]._want.load (std::memory_order_relaxed))
+        {
+            J->done [i] = true;
+            J->sel [m++] = i;
+        }
     }
-    for (n = _n0, P = _pipes; n <= _n1; n++, P++) P->_out = out + ((n % a) + b) * PERIOD;
+    while ((m < n) && (J->k <= _n1 - _n0))
+    {
+        j = J->ord [J->k++];
+        if (! J->done [j])
+        {
+            J->done [j] = true;
+            J->sel [m++] = j;
+        }
+    }
+    if (pool) pool->run (gen_pipe, J, m);
+    else for (i = 0; i < m; i++) gen_pipe (J, i);
+    if ((J->n -= m)) return J->n;
+    delete J;
+    _job = nullptr;
+    return 0;
 }
 
 
-void Rankwave::play (int shift)
+bool Rankwave::gen_want () const
 {
-    Pipewave *P, *Q;
+    if (! _job) return false;
+    for (int i = 0; i <= _n1 - _n0; i++)
+    {
+        if (! _job->done [i] && _pipes [i]._want.load (std::memory_order_relaxed)) return true;
+    }
+    return false;
+}
 
 
-    for (P = nullptr, Q = _list; Q; Q = Q->_link)
+size_t Rankwave::wavesize (Addsynth *D, float fsamp, float fbase, float *scale, int lmax)
+{
+    int       i, nc;
+    size_t    k;
+    float     *fp;
+    Pipewave  P;
+
+    // The lengths genwave () would choose, without the random detune.
+    fp = new float [_n1 - _n0 + 1];
+    fpipes (D, fbase, scale, fp);
+    k = 0;
+    for (i = 0; i <= _n1 - _n0; i++)
     {
+        if (fp [i] > 0) k += P.genlen (D, i, fsamp, fp [i] / fsamp, lmax, &nc);
+    }
+    delete[] fp;
+    return k * sizeof (wave_t);
+}
 
 
-        Q->play ();
-        if (shift) Q->_sdel = (Q->_sdel >> 1) | Q->_sbit;
-        if (Q->_sdel || Q->_p_p || Q->_p_r) P = Q;
-        else
-        {
-            if (P) P->_link = Q->_link;
-            else      _list = Q->_link;
-        }
+void Rankwave::ratios (Addsynth *D, float fbase, float *scale, float *r)
+{
+    int    i, n;
+    float  *fp;
+
+    n = _n1 - _n0 + 1;
+    fp = new float [n];
+    fpipes (D, _fbase, _scale, fp);
+    fpipes (D, fbase, scale, r);
+    for (i = 0; i < n; i++) r [i] = ((fp [i] > 0) && (r [i] > 0)) ? r [i] / fp [i] : 1.0f;
+    delete[] fp;
+}
+
+
+void Rankwave::retune (const float *r)
+{
+    for (int i = 0; i <= _n1 - _n0; i++) _pipes [i].retune (r [i]);
+}
+
+
+void Rankwave::detach ()
+{
+    if (_voices) for (int i = 0; i <= _n1 - _n0; i++) _voices->detach (_pipes + i);
+    _voices = nullptr;
+}
+
+
+void Rankwave::set_param (Voicetab *voices, int ind, float *out, int del, int pan)
+{
+    int         n, a, b;
+    Pipewave   *P;
+
+    _voices = voices;
+    _index = ind;
+    _sbit = 1 << del;
+    switch (pan)
+    {
+        case 'L': a = 2, b = 0; break;
+        case 'C': a = 2, b = 1; break;
+        case 'R': a = 2, b = 2; break;
+        default:  a = 4, b = 0;
     }
+    for (n = _n0, P = _pipes; n <= _n1; n++, P++) P->_out = out + ((n % a) + b) * PERIOD;
 }
 
+
 // Function to check whether a directory exists or not
 int isDirectoryExists(const char *path) {
     struct stat stats{};
@@ -575,177 +1233,417 @@ int isDirectoryExists(const char *path) {
 }
 
 
-int Rankwave::save (const char *path, Addsynth *D, float fsamp, float fbase, float *scale)
+uint64_t Rankwave::rankkey () const
 {
-    FILE      *F;
-    Pipewave  *P;
-    int        i;
-    char       name [1024];
-    char       data [64];
-    char      *p;
-
+    int       i;
+    uint64_t  k;
 
-    sprintf (name, "%s/%s", path, D->_filename);
-    if(isDirectoryExists(path)==0)
+    // FNV-1a over the generation keys, as in Pipewave::genkey.
+    k = 0xcbf29ce484222325ULL;
+    for (i = 0; i <= _n1 - _n0; i++)
     {
-
-        mkdir(path, 0777);
-        if(isDirectoryExists(path)==0) {
-            __android_log_print(android_LogPriority::ANDROID_LOG_WARN,
-                                "Rankwave::save", "Could not create wave directory %s", path);
+        const unsigned char *b = (const unsigned char *) &_pipes [i]._key;
+        for (int j = 0; j < (int) sizeof (uint64_t); j++)
+        {
+            k ^= b [j];
+            k *= 0x100000001b3ULL;
         }
     }
-    if ((p = strrchr (name, '.'))) strcpy (p, ".ae1");
+    return k;
+}
+
+
+void Rankwave::cachename (char *name, const char *path, Addsynth *D, bool keyed) const
+{
+    char      *p;
+
+    snprintf (name, 1000, "%s/%s", path, D->_filename);
+    if ((p = strrchr (name, '.')) && (p > strrchr (name, '/'))) *p = 0;
+    if (keyed) sprintf (name + strlen (name), "-%016llx.ae1", (unsigned long long) rankkey ());
     else strcat (name, ".ae1");
+}
 
-    __android_log_print(android_LogPriority::ANDROID_LOG_INFO,
-                        "Rankwave::save", "%s", name);
 
-    F = fopen (name, "wb");
-    if (F == nullptr)
+char *Rankwave::image (float fsamp, size_t *size)
+{
+    Pipewave  *P;
+    int        i, n;
+    int64_t    offs;
+    char      *data;
+    char      *index;
+
+    // The index, 64 bytes per pipe: its descriptor, the offset of its samples and its peak level.
+    // The samples follow, 64 byte aligned for the vectorized reads, the first ones page aligned.
+    n = _n1 - _n0 + 1;
+    index = new char [64 * n];
+    memset (index, 0, 64 * n);
+    offs = (80 + 64 * n + AE1_PAGE - 1) & ~(int64_t)(AE1_PAGE - 1);
+#if WAVE_PACK
+    // Compressed, the index entry also holds their size and number of bits.
+    uint8_t **pk = new uint8_t* [n];
+    for (i = 0, P = _pipes; i < n; i++, P++)
     {
-        __android_log_print(android_LogPriority::ANDROID_LOG_ERROR,
-                            "Rankwave::save",
-                            "Can't open waveform file '%s' for writing\n", name);
-
-        return 1;
+        int32_t  b = (WAVE16 && (WAVE_PACK > 16)) ? 16 : WAVE_PACK;
+        int32_t  k = 0;
+        size_t   m = 0;
+        float    g = 0;
+
+        pk [i] = P->_p0 ? P->pack (b, &m, &g) : nullptr;
+        k = (int32_t) m;
+        P->getdesc (index + 64 * i, g);
+        memcpy (index + 64 * i + 32, &offs, sizeof (offs));
+        memcpy (index + 64 * i + 40, &P->_peak, sizeof (float));
+        memcpy (index + 64 * i + 44, &k, sizeof (int32_t));
+        memcpy (index + 64 * i + 48, &b, sizeof (b));
+        offs += (k + 63) & ~(int64_t) 63;
     }
+#else
+    for (i = 0, P = _pipes; i < n; i++, P++)
+    {
+        P->getdesc (index + 64 * i);
+        memcpy (index + 64 * i + 32, &offs, sizeof (offs));
+        memcpy (index + 64 * i + 40, &P->_peak, sizeof (float));
+        offs += (P->size () * sizeof (wave_t) + 63) & ~(int64_t) 63;
+    }
+#endif
 
-    memset (data, 0, 16);
+    // The padding stays zero.
+    *size = offs;
+    data = new char [offs];
+    memset (data, 0, offs);
     strcpy (data, "ae1");
-    data [4] = 1;
-    fwrite (data, 1, 16, F);
-
-    memset (data, 0, 64);
-    data [0] = 0;
-    data [1] = 0;
-    data [2] = 0;
-    data [3] = 0;
-    data [4] = _n0;
-    data [5] = _n1;
-    data [6] = 0;
-    data [7] = 0;
-    *((float *)(data +  8)) = fsamp;
-    *((float *)(data + 12)) = fbase;
-    memcpy (data + 16, scale, 12 * sizeof (float));
-    fwrite (data, 1, 64, F);
-
-    for (i = _n0, P = _pipes; i <= _n1; i++, P++) P->save (F);
-
-    fclose (F);
+    data [4] = 2;
+    data [20] = _n0;
+    data [21] = _n1;
+    memcpy (data + 24, &fsamp, sizeof (float));
+    memcpy (data + 28, &_fbase, sizeof (float));
+    memcpy (data + 32, _scale, 12 * sizeof (float));
+    memcpy (data + 80, index, 64 * n);
+    for (i = 0, P = _pipes; i < n; i++, P++)
+    {
+        memcpy (&offs, index + 64 * i + 32, sizeof (offs));
+#if WAVE_PACK
+        int32_t  k;
 
+        memcpy (&k, index + 64 * i + 44, sizeof (k));
+        if (pk [i]) memcpy (data + offs, pk [i], k);
+        delete[] pk [i];
+#else
+        if (P->_p0) memcpy (data + offs, P->_p0, P->size () * sizeof (wave_t));
+#endif
+    }
+#if WAVE_PACK
+    delete[] pk;
+#endif
+    delete[] index;
     _modif = false;
-    return 0;
+    return data;
 }
 
 
-int Rankwave::load (const char *path, Addsynth *D, float fsamp, float fbase, float *scale)
+int Rankwave::check (const char *data, size_t size, const char *name, float fsamp, float fbase, float *scale)
 {
-    FILE      *F;
-    Pipewave  *P;
-    int        i;
-    char       name [1024];
-    char       data [64];
-    char      *p;
-    float      f;
-
-    sprintf (name, "%s/%s", path, D->_filename);
-
+    int    i;
+    float  f;
 
-
-    if ((p = strrchr (name, '.'))) strcpy (p, ".ae1");
-    else strcat (name, ".ae1");
-
-    F = fopen (name, "rb");
-    if (F == NULL)
-    {
-        __android_log_print(android_LogPriority::ANDROID_LOG_WARN,
-                            "Rankwave", "Can't open waveform file '%s' for reading", name);
-
-
-        return 1;
-    }
-
-    fread (data, 1, 16, F);
-    if (strcmp (data, "ae1"))
+    if ((size < 80) || strcmp (data, "ae1"))
     {
         __android_log_print(android_LogPriority::ANDROID_LOG_WARN,
                             "Rankwave", "File '%s' is not an Aeolus waveform file", name);
-
-
-        fclose (F);
-        return 1;
+        return -1;
     }
-
-    if (data [4] != 1)
+    if ((data [4] != 1) && (data [4] != 2))
     {
-
         __android_log_print(android_LogPriority::ANDROID_LOG_WARN,
                             "Rankwave", "File '%s' has an incompatible version tag (%d)", name, data [4]);
-
-#ifdef DEBUG
-        fprintf (stderr,
-#endif
-        fclose (F);
-        return 1;
+        return -1;
     }
-
-    fread (data, 1, 64, F);
-    if (_n0 != data [4] || _n1 != data [5])
+    if (_n0 != data [20] || _n1 != data [21])
     {
         __android_log_print(android_LogPriority::ANDROID_LOG_WARN,
-                            "Rankwave", "File '%s' has an incompatible note range (%d %d), (%d %d)", name, _n0, _n1, data [4], data [5]);
-
-
-        fclose (F);
-        return 1;
+                            "Rankwave", "File '%s' has an incompatible note range (%d %d), (%d %d)", name, _n0, _n1, data [20], data [21]);
+        return -1;
     }
-
-    f = *((float *)(data + 8));
+    memcpy (&f, data + 24, sizeof (float));
     if (fabsf (f - fsamp) > 0.1f)
     {
         __android_log_print(android_LogPriority::ANDROID_LOG_WARN,
                             "Rankwave",
                             "File '%s' has a different sample frequency (%3.1lf)", name, f);
-
-
-        fclose (F);
-        return 1;
+        return -1;
     }
-
-    f = *((float *)(data + 12));
+    memcpy (&f, data + 28, sizeof (float));
     if (fabsf (f - fbase) > 0.1f)
     {
-
-
         __android_log_print(android_LogPriority::ANDROID_LOG_WARN,
                             "Rankwave",
                             "File '%s' has a different tuning (%3.1lf)\n", name, f);
-
-        fclose (F);
-        return 1;
+        return -1;
     }
-
     for (i = 0; i < 12; i++)
     {
-        f = *((float *)(data + 16 + 4 * i));
+        memcpy (&f, data + 32 + 4 * i, sizeof (float));
         if (fabsf (f /  scale [i] - 1.0f) > 6e-5f)
         {
             __android_log_print(android_LogPriority::ANDROID_LOG_WARN,
                                 "Rankwave",
                                 "File '%s' has a different temperament", name);
+            return -1;
+        }
+    }
+    return data [4];
+}
+
 
+void Rankwave::unpack_pipe (void *arg, int n)
+{
+    Unpackjob  *J = (Unpackjob *) arg;
+
+    n = J->sel [n];
+    if (J->P [n].unpack (J->d + 80 + 64 * n, J->d)) J->err = 1;
+}
 
 
-            fclose (F);
+int Rankwave::loadmap (Wavemap *M, size_t base, size_t size, Genpool *pool)
+{
+    Pipewave   *P;
+    Unpackjob   J;
+    int         i, n, r;
+    size_t      k;
+    timespec    t0, t1;
+
+    if (size < (size_t)(80 + 64 * (_n1 - _n0 + 1))) return 1;
+    J.P = _pipes;
+    J.d = M->data () + base;
+    J.sel = new int [_n1 - _n0 + 1];
+    J.err = 0;
+    n = 0;
+    k = 0;
+    for (i = _n0, P = _pipes; i <= _n1; i++, P++)
+    {
+        r = P->load (M, M->data () + base + 80 + 64 * (i - _n0), base, base + size);
+        if (r == 1)
+        {
+            delete[] J.sel;
             return 1;
         }
+        if (r == 2)
+        {
+            J.sel [n++] = i - _n0;
+            k += P->size () * sizeof (wave_t);
+        }
+    }
+    if (n)
+    {
+        // Compressed pipes, decoded in parallel straight into their tables.
+        clock_gettime (CLOCK_MONOTONIC, &t0);
+        if (pool) pool->run (unpack_pipe, &J, n);
+        else for (i = 0; i < n; i++) unpack_pipe (&J, i);
+        clock_gettime (CLOCK_MONOTONIC, &t1);
+        double t = (t1.tv_sec - t0.tv_sec) + 1e-9 * (t1.tv_nsec - t0.tv_nsec);
+        __android_log_print(android_LogPriority::ANDROID_LOG_DEBUG,
+                            "Rankwave", "Unpacked %d pipes, %.1lf MB in %.1lf ms, %.0lf MB/s",
+                            n, k / 1048576.0, 1e3 * t, (t > 0) ? k / (1048576.0 * t) : 0.0);
     }
+    delete[] J.sel;
+    return J.err;
+}
 
-    for (i = _n0, P = _pipes; i <= _n1; i++, P++) P->load (F);
 
-    fclose (F);
+void Rankwave::resample_pipe (void *arg, int n)
+{
+    Resamplejob  *J = (Resamplejob *) arg;
 
-    _modif = false;
+    n = J->sel [n];
+    J->P [n].resample (J->S + n, J->rep [n], J->r, J->A, J->L [n]);
+}
+
+
+void Rankwave::resample (Rankwave *S, Addsynth *D, float fs1, float fs2, float fbase, float *scale, int lmax, Genpool *pool)
+{
+    Pipewave     *P, *Q;
+    Resamplejob   J;
+    Waveresamp  **F;
+    Wavetab      *T;
+    int           i, j, m, n, nf;
+    float         f, ri, ro, fa, fb, *fp;
+
+    n = _n1 - _n0 + 1;
+    fp = new float [n];
+    fpipes (D, fbase, scale, fp);
+    J.P = _pipes;
+    J.S = S->_pipes;
+    J.sel = new int [n];
+    J.rep = new int [n];
+    J.L = new Waveresamp* [n];
+    J.r = fs2 / fs1;
+    // One filter for the attacks, and one for each pair of old and new loop rates. The pass band
+    // holds the harmonics below 0.42 of the lower sampling frequency, and what is above half the
+    // lower of the input and output rates is removed.
+    f = fminf (fs1, fs2);
+    F = new Waveresamp* [n + 1];
+    F [0] = J.A = new Waveresamp (0.42f * f / fs1, 0.5f * f / fs1);
+    nf = 1;
+    m = 0;
+    for (i = 0, P = _pipes, Q = S->_pipes; i < n; i++, P++, Q++)
+    {
+        if ((fp [i] <= 0) || ! Q->_tab || (Q->_l1 <= 0)) continue;
+        if ((T = Wavetab::find (P->_key)))
+        {
+            // Already in memory for another rank.
+            P->attach (T);
+            continue;
+        }
+        J.rep [i] = P->reslen (Q, D, i, fs1, fs2, fp [i], lmax);
+        ri = fs1 * Q->step ();
+        ro = fs2 * P->step ();
+        fa = 0.42f * fminf (fminf (ri, ro), f) / ri;
+        fb = 0.5f * fminf (ri, ro) / ri;
+        for (j = 1; (j < nf) && ! F [j]->same (fa, fb); j++);
+        if (j == nf) F [nf++] = new Waveresamp (fa, fb);
+        J.L [i] = F [j];
+        J.sel [m++] = i;
+    }
+    if (pool) pool->run (resample_pipe, &J, m);
+    else for (i = 0; i < m; i++) resample_pipe (&J, i);
+    for (j = 0; j < nf; j++) delete F [j];
+    delete[] F;
+    delete[] J.L;
+    delete[] J.rep;
+    delete[] J.sel;
+    delete[] fp;
+}
+
+
+#if WAVE_RESAMPLE
+int Rankwave::loadalt (Addsynth *D, float fsamp, float fbase, float *scale, int lmax, Wavebundle *B, Genpool *pool)
+{
+    int        i, e;
+    float      f;
+    size_t     base, size;
+    Wavemap   *M;
+    timespec   t0, t1;
+
+    for (i = 0; i < (int)(sizeof (altrates) / sizeof (float)); i++)
+    {
+        f = altrates [i];
+        if (fabsf (f - fsamp) <= 0.1f) continue;
+        // The rank as it was generated at that rate, with the loop length limit scaled to it.
+        Rankwave S (_n0, _n1);
+        S.setkeys (D, f, fbase, scale, (int)((double) lmax * f / fsamp + 0.5));
+        if (! (M = B->find (S.rankkey (), &base, &size))) continue;
+        e = (S.check (M->data () + base, size, D->_filename, f, fbase, scale) == 2) ? S.loadmap (M, base, size, pool) : 1;
+        M->release ();
+        if (e) continue;
+        clock_gettime (CLOCK_MONOTONIC, &t0);
+        resample (&S, D, f, fsamp, fbase, scale, lmax, pool);
+        clock_gettime (CLOCK_MONOTONIC, &t1);
+        __android_log_print(android_LogPriority::ANDROID_LOG_INFO,
+                            "Rankwave", "Resampled '%s' from %.0lf Hz in %.1lf ms", D->_filename, (double) f,
+                            1e3 * (t1.tv_sec - t0.tv_sec) + 1e-6 * (t1.tv_nsec - t0.tv_nsec));
+        // Saved at the current rate by the next save.
+        _fbase = fbase;
+        memcpy (_scale, scale, 12 * sizeof (float));
+        _modif = true;
+        return 0;
+    }
+    return 1;
+}
+#endif
+
+
+void Rankwave::setkeys (Addsynth *D, float fsamp, float fbase, float *scale, int lmax)
+{
+    Pipewave  *P;
+    int        i;
+    float     *fp;
+
+    fp = new float [_n1 - _n0 + 1];
+    fpipes (D, fbase, scale, fp);
+    for (i = _n0, P = _pipes; i <= _n1; i++, P++)
+    {
+        P->_key = (fp [i - _n0] > 0) ? Pipewave::genkey (D, i - _n0, fsamp, fp [i - _n0], lmax) : 0;
+    }
+    delete[] fp;
+}
+
+
+int Rankwave::load (const char *path, Addsynth *D, float fsamp, float fbase, float *scale, int lmax, Wavebundle *B, Genpool *pool)
+{
+    FILE      *F;
+    Pipewave  *P;
+    int        i, v, e;
+    size_t     base, size;
+    char       name [1024];
+    Wavemap   *M;
+
+    // The image of this rank is found by the generation keys of its pipes.
+    setkeys (D, fsamp, fbase, scale, lmax);
+    e = 1;
+    if (B && (M = B->find (rankkey (), &base, &size)))
+    {
+        if (check (M->data () + base, size, D->_filename, fsamp, fbase, scale) == 2) e = loadmap (M, base, size, pool);
+        M->release ();
+        if (! e)
+        {
+            _fbase = fbase;
+            memcpy (_scale, scale, 12 * sizeof (float));
+            _modif = false;
+            return 0;
+        }
+    }
+
+    // Otherwise a file of its own, as written before there were bundles, named
+    // by its generation keys, or by the stop alone in the earlier versions.
+    cachename (name, path, D, true);
+    if (! (M = Wavemap::open (name)))
+    {
+        cachename (name, path, D, false);
+        M = Wavemap::open (name);
+    }
+    v = M ? check (M->data (), M->size (), name, fsamp, fbase, scale) : -1;
+    if (v < 0)
+    {
+        if (M) M->release ();
+#if WAVE_RESAMPLE
+        // Or the rank at another sample rate in the bundle, resampled.
+        if (B && ! loadalt (D, fsamp, fbase, scale, lmax, B, pool)) return 0;
+#endif
+        if (! M)
+        {
+            __android_log_print(android_LogPriority::ANDROID_LOG_WARN,
+                                "Rankwave", "Can't open waveform file '%s' for reading", name);
+        }
+        return 1;
+    }
+    if (v == 2)
+    {
+        // Version 2 files are used mapped, and the tables point into the mapping.
+        e = loadmap (M, 0, M->size (), pool);
+    }
+    else if ((v == 1) && (F = fopen (name, "rb")))
+    {
+        // Version 1 files are read.
+        e = fseek (F, 80, SEEK_SET);
+        for (i = _n0, P = _pipes; (i <= _n1) && ! e; i++, P++) e = P->load (F);
+        fclose (F);
+    }
+    M->release ();
+    if (e)
+    {
+        __android_log_print(android_LogPriority::ANDROID_LOG_WARN,
+                            "Rankwave", "File '%s' is truncated or has an unknown sample format", name);
+        return 1;
+    }
+
+    // Moved into the bundle by the next save, and only then deleted.
+    if (B)
+    {
+        _oldfile = new char [strlen (name) + 1];
+        strcpy (_oldfile, name);
+    }
+    _fbase = fbase;
+    memcpy (_scale, scale, 12 * sizeof (float));
+    _modif = B != nullptr;
     return 0;
 }
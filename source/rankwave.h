@@ -22,12 +22,25 @@
 #define AEOLUS_RANKWAVE_H
 
 
+#include <atomic>
 #include "addsynth.h"
+#include "genpool.h"
 #include "rngen.h"
+#include "voicetab.h"
+#include "wavekern.h"
+#include "wavetab.h"
 #include <android/log.h>
 
 
 #define PERIOD 64
+#define AE1_PAGE 16384 // alignment of the samples in .ae1 files, a multiple of the page size
+
+#ifndef WAVE_RESAMPLE // Resample a rank found in the bundle at another sample rate instead of generating it again
+# define WAVE_RESAMPLE 1
+#endif
+
+
+class Waveresamp;
 
 
 class Pipewave
@@ -38,49 +51,238 @@ private:
      * Constructor, initializes to null values and non-defined data arrays (nullptr)
      */
     Pipewave () :
-            _p0 (nullptr), _p1 (nullptr), _p2 (nullptr), _l1 (0), _k_s (0),  _k_r (0), _m_r (0),
-            _link (nullptr), _sbit (0), _sdel (0),
-            _p_p (nullptr), _p_f(0), _y_p (0), _z_p (0), _p_r (0), _y_r (0), _g_r (0), _i_r (0)
+            _p0 (nullptr), _p1 (nullptr), _p2 (nullptr), _l1 (0), _k_s (0), _k_d (1), _k_r (0), _m_r (0),
+            _slot (-1), _key (0), _tab (nullptr)
     {}
 
     /**
-     *  Destructor, frees the wave point buffer array starting at point _p0
+     *  Destructor, gives back the reference to the shared wavetable
      */
 
-    ~Pipewave () { delete[] _p0; }
+    ~Pipewave () { if (_tab) _tab->release (); }
 
     friend class Rankwave;
+    friend class Voicetab;
     /**
      * Generate wave: Allocate memory for the data array starting at _p0 and generate
      * wavetable to be used for a particular pipe. The synthesis algorithm is based on
      * harmonics, a loop length to fit in the harmonics as closely as possible without glitch,
-     * and a transition from attach harmonic distribution to continuous harmonic distribution
+     * and a transition from attach harmonic distribution to continuous harmonic distribution.
+     * The random variations are seeded from _key, so that the result only depends on the parameters.
      * @param D Addsynth holding the applicable parameters
      * @param n The midi note n of this pipe
      * @param fsamp sampling frequency
      * @param fpipe Base frequency of this pipe
+     * @param lmax Maximum loop length, see looplen
+     */
+    void genwave (Addsynth *D, int n, float fsamp, float fpipe, int lmax);
+    /**
+     * Choose the attack length, the loop rate and the loop length as genwave does, setting
+     * _l0, _k_s, _k_d and _l1. This is also used to predict the size of a rank, see Rankwave::wavesize.
+     * @param D Addsynth holding the applicable parameters
+     * @param n The note index, as for genwave
+     * @param fsamp Sampling frequency
+     * @param f1 Pipe frequency relative to the sampling frequency
+     * @param lmax Maximum loop length, see looplen
+     * @param nc Output, the number of cycles in the loop
+     * @return The number of samples of the wavetable
+     */
+    int genlen (Addsynth *D, int n, float fsamp, float f1, int lmax, int *nc);
+    /**
+     * Set the release parameters _k_r, _m_r, _d_r and _d_p, as genwave does. The loop rate must have been chosen.
+     * @param D Addsynth holding the applicable parameters
+     * @param n The note index, as for genwave
+     * @param fsamp Sampling frequency
+     */
+    void genrel (Addsynth *D, int n, float fsamp);
+    /**
+     * Choose the lengths, the loop rate and the release parameters for resampling the wavetable of the same
+     * pipe at another sampling frequency, as genlen does for genwave. The loop rate is the one genwave would
+     * use at the new frequency, and the loop holds one or more loops of S, fitted into an integer number of
+     * samples with the smallest pitch error within lmax.
+     * @param S The pipe at the old sampling frequency, loaded
+     * @param D Addsynth holding the applicable parameters
+     * @param n The note index, as for genwave
+     * @param fs1 Old sampling frequency
+     * @param fs2 New sampling frequency
+     * @param fpipe Frequency of this pipe, without the random detune
+     * @param lmax Maximum loop length at the new sampling frequency, see looplen
+     * @return The number of loops of S in the new loop
+     */
+    int reslen (const Pipewave *S, Addsynth *D, int n, float fs1, float fs2, float fpipe, int lmax);
+    /**
+     * Resample the wavetable of the same pipe at another sampling frequency into a new Wavetab, register it
+     * and use it, after reslen (). The attack is resampled from the same start, running on into the loop of S
+     * up to the next PERIOD, and the loop cyclically from where the attack ends, so that it closes without
+     * a discontinuity and continues the attack as the loop of S did.
+     * @param S The pipe at the old sampling frequency
+     * @param m Number of loops of S in the new loop, as returned by reslen
+     * @param r Ratio of the new and the old sampling frequency
+     * @param A Filter for the attack, with its band edges relative to the old sampling frequency
+     * @param L Filter for the loop, with its band edges relative to the old loop rate
+     */
+    void resample (const Pipewave *S, int m, float r, const Waveresamp *A, const Waveresamp *L);
+    /**
+     * Write the descriptor of this pipe in the format of the wavetable file
+     * @param p Output, 32 bytes
+     * @param g Quantization step of compressed samples (see pack), or 0 if they are stored as they are
      */
-    void genwave (Addsynth *D, int n, float fsamp, float fpipe);
+    void getdesc (void *p, float g = 0) const;
     /**
-     * Save the wavetable for this pipe and associated description to file in binary format
-     * @param F File pointer for writing
+     * Set the descriptor of this pipe from the wavetable file, including the scale of 16 bit samples
+     * @param p The descriptor, 32 bytes
+     * @return The sample format, 0 for float, 1 for 16 bit and 2 for compressed, or -1 if the descriptor is invalid
      */
-    void save (FILE *F);
+    int setdesc (const void *p);
     /**
-     * Load the wavetable for this pipe from binary file
+     * Load the wavetable for this pipe from a version 1 binary file. The samples are converted if they were
+     * saved in the other format (float or 16 bit, see WAVE16).
      * @param F File pointer for reading, set to the beginning of the data section for this pipe
+     * @return 0 on success, 1 on error
+     */
+    int load (FILE *F);
+    /**
+     * Load the wavetable for this pipe from a mapped version 2 image, see Rankwave::image. The table
+     * points into the mapping, unless the samples have to be converted to the other format.
+     * @param M The mapping
+     * @param d The index entry of this pipe in the mapping
+     * @param base Offset of the image in the mapping, the offsets in the index are relative to it
+     * @param end Offset of the end of the image in the mapping
+     * @return 0 on success, 1 on error, 2 if the samples are compressed and still have to be unpacked
+     */
+    int load (Wavemap *M, const char *d, size_t base, size_t end);
+    /**
+     * Compress the samples of this pipe, see wavepack
+     * @param b Number of bits of the quantized samples
+     * @param n Output, size of the compressed samples in bytes
+     * @param g Output, quantization step
+     * @return The compressed samples, to be deleted by the caller
+     */
+    uint8_t *pack (int b, size_t *n, float *g) const;
+    /**
+     * Decompress the samples of this pipe into a new wavetable, register it and use it. This is done
+     * after load () returned 2, and may run for several pipes in parallel.
+     * @param d The index entry of this pipe in the mapping
+     * @param p The image in the mapping
+     * @return 0 on success, 1 if the samples are corrupt
+     */
+    int unpack (const char *d, const char *p);
+    /**
+     * Store samples of the other format than WAVE16 selects, as read from a file
+     * @param p The samples
+     * @param f Their format, as returned by setdesc
+     * @param k Number of samples
+     */
+    void convert (const void *p, int f, int k);
+    /**
+     * Store a wavetable computed in floating point in a new Wavetab, register it and use it.
+     * With WAVE16 the samples are scaled to the full 16 bit range and rounded.
+     * @param w The samples, size () of them
+     */
+    void store (const float *w);
+    /**
+     * Use a shared wavetable, copying its descriptor and giving back the previous one
+     * @param T The table, the reference of the caller is taken over
      */
-    void load (FILE *F);
+    void attach (Wavetab *T);
     /**
-     * Play from the wavetable. Playing means looping through the wavetable (including initial attack)
-     * while the pipe is on  (the _sdel bit is set) and exponentially releasing the pipe when
-     * the pipe is turned off
-     * Technically, a play pointer (_p_p, internally p) and a release point (_p_r) are moved through
-     * the wavetable sections, with small variations to create a more realistic sound, and
-     * the corresponding audio data is moved into the output buffer designated by
-     * _out
+     * Create a new, unregistered Wavetab with the descriptor of this pipe
+     * @param k Number of samples
+     * @param M Mapping holding the samples, or nullptr to allocate them
+     * @param offs Offset of the samples in the mapping
+     * @return The table
      */
-    void play ();
+    Wavetab *newtab (int k, Wavemap *M = nullptr, size_t offs = 0);
+    /**
+     * Generation key: a 64 bit FNV-1a hash of everything genwave depends on for this pipe,
+     * i.e. the values of the stop parameters at this note, the sampling and pipe frequencies,
+     * the maximum loop length and the sample format. Pipes with the same key have identical wavetables.
+     * @param D Addsynth holding the applicable parameters
+     * @param n The note index, as for genwave
+     * @param fsamp Sampling frequency
+     * @param fpipe Frequency of this pipe
+     * @param lmax Maximum loop length, see looplen
+     * @return The key
+     */
+    static uint64_t genkey (Addsynth *D, int n, float fsamp, float fpipe, int lmax);
+    /**
+     * Interpolating read of one PERIOD from the loop section, using the vectorized kernel
+     * in wavekern.h. This is shared by the playing and the releasing part of Voicetab::play.
+     * The loop wraps both ways: a read before its start, with a negative detune, is of its
+     * last sample, not of the last attack sample.
+     * @param p Read pointer, inside the loop section
+     * @param y Pointer to the fractional read position, updated
+     * @param dy Detune, i.e. deviation of the advance per sample from the sample step, see step ()
+     * @param q Output buffer
+     * @param g Gain for the first sample, not including _scale
+     * @param dg Gain decrement per sample, not including _scale
+     * @return The updated read pointer
+     */
+    wave_t *loop (wave_t *p, float *y, float dy, float *q, float g, float dg);
+    /**
+     * Advance the read position by one PERIOD in the loop section without producing output,
+     * for pipes that are inaudible. The position ends up exactly where loop () would leave it.
+     * @param p Read pointer, inside the loop section
+     * @param y Pointer to the fractional read position, updated
+     * @param dy Detune, as for loop ()
+     * @return The updated read pointer
+     */
+    wave_t *skip (wave_t *p, float *y, float dy);
+    /**
+     * Interpolating read of one PERIOD from the attack section for a retuned pipe, with an advance
+     * of _ratio attack samples per output sample. If the end of the attack is reached, the rest
+     * of the PERIOD is read from the loop section, with the advance and detune of loop ().
+     * Pipes that are not retuned copy the attack samples directly instead.
+     * @param p Read pointer, inside the attack section
+     * @param y Pointer to the fractional read position, updated. In the attack this is in attack
+     *        samples, and the first sample is read at p + *y.
+     * @param dy Detune for the loop section, as for loop ()
+     * @param q Output buffer
+     * @param g Gain for the first sample, not including _scale
+     * @param dg Gain decrement per sample, not including _scale
+     * @return The updated read pointer, in the loop section if the attack has ended
+     */
+    wave_t *attack (wave_t *p, float *y, float dy, float *q, float g, float dg);
+    /**
+     * Set the playback rate relative to the tuning the wavetable was generated for, see
+     * Rankwave::retune. The ratio is limited to a fifth either way, which keeps the reads
+     * of attack () within the samples copied after the loop.
+     * @param r The ratio of the new and the generated pipe frequency
+     */
+    void retune (float r);
+    /**
+     * Advance per output sample in the loop section, in table samples. This is _k_s for loops
+     * stored at _k_s times the sampling frequency, or a fraction 1 / _k_d for loops stored at a
+     * reduced rate. PERIOD times the step is always an integer.
+     * @return The sample step
+     */
+    [[nodiscard]] float step () const { return (float) _k_s / _k_d; }
+    /**
+     * Number of samples of the wavetable: the attack, the loop, and the copy of the loop start
+     * needed by the interpolation
+     * @return The size
+     */
+    [[nodiscard]] int size () const { return _l0 + _l1 + _k_s * (PERIOD + 4); }
+    /**
+     * Is the wavetable of this pipe available. This is set by attach () once the descriptor
+     * is complete, so that the audio thread can play the pipes of a rank that is still being
+     * generated, see Rankwave::gen_some.
+     * @return true if the pipe can be played
+     */
+    [[nodiscard]] bool ready () const { return _ready.load (std::memory_order_acquire); }
+    /**
+     * Table rate of the loop section. The loop is stored at the lowest of fsamp / 4, fsamp / 2,
+     * fsamp, 2 * fsamp and 3 * fsamp for which the highest significant harmonic (-40 dB) stays
+     * below 1/8 of the table rate, the limit for linear interpolation already used for the
+     * oversampled loops, and every harmonic that is generated at all (-80 dB) stays below 0.45
+     * of it, so that reducing the rate never drops a harmonic.
+     * @param D Addsynth holding the applicable parameters
+     * @param n The note index, as for genwave
+     * @param f1 Pipe frequency relative to the sampling frequency
+     * @param k_s Output, the oversampling factor, 1 if the rate is reduced
+     * @param k_d Output, the rate reduction factor, 1 if the loop is oversampled
+     */
+    static void looprate (Addsynth *D, int n, float f1, int16_t *k_s, int16_t *k_d);
 
     /**
  * @brief Loop length: Find a combination of a number of entire number of cycles bb at pipe base frequency f and number
@@ -104,7 +306,9 @@ private:
  *
  * @param f Frequency of the pipe
  * @param fsamp sampling frequency, in the implementation here can include up to 3x oversampling
- * @param lmax maximum externally imposed loop length, the iteration will stop to avoid aa exceeding lmax
+ * @param lmax maximum externally imposed loop length, the iteration will stop to avoid aa exceeding lmax.
+ *        A smaller lmax saves memory at the cost of pitch accuracy: the loop then holds as many cycles as
+ *        fit, with an error of up to half a sample over its length, or one cycle if even that does not fit
  * @param aa Pointer to the length of the loop for output
  * @param bb Pointer to the number of cycles in the loop fot output
  */
@@ -112,14 +316,16 @@ private:
     /** Wavetable preparation: Calculate the attack part (initial part, when pipe is turned on)
      * The basic idea is to simulate higher frequency components which are initially produced when
      * the pipe starts playing, before the main harmonics set in. This function
+     * @param att Output, the attack gain for each sample
      * @param n The number of samples to be prepared
      * @param p The profile of the attack, the higher p, the shorter the attack peak
      */
-    static void attgain (int n, float p);
+    static void attgain (float *att, int n, float p);
 
-    float     *_p0;    // wavetable data pointer: attack start
-    float     *_p1;    // wavetable data pointer: loop start
-    float     *_p2;    // wavetable data pointer: loop end
+    wave_t    *_p0;    // wavetable data pointer: attack start
+    wave_t    *_p1;    // wavetable data pointer: loop start
+    wave_t    *_p2;    // wavetable data pointer: loop end
+    float      _scale{1.0f}; // gain applied to the samples
     /**
      * Attack length (number of sample points for attack length)
      */
@@ -129,35 +335,26 @@ private:
      */
     int32_t    _l1;
     int16_t    _k_s;   // sample step, i.e. periods of pre-sampling minimally required
+    int16_t    _k_d;   // loop rate reduction, the loop is read with a step of _k_s / _k_d
     int16_t    _k_r;   // release lenght
     float      _m_r;   // release multiplier
     float      _d_r{};   // release detune
     float      _d_p{};   // instability
+    float      _ratio{1.0f}; // playback rate relative to the tuning of the table, see retune
+    float      _d_t{};   // retune detune, (_ratio - 1) scaled to the sample step
 
-    Pipewave  *_link;  // link to next pipe in active chain
-    uint32_t   _sbit;  // on state bit
-    uint32_t   _sdel;  // delayed state
+    float      _peak{};  // peak level of the loop section
     float     *_out{};   // audio output buffer
-    float     *_p_p;   // play pointer
-    float      _p_f;   // play pointer fraction
-    float      _y_p;   // play interpolation
-    float      _z_p;   // play interpolation speed
-    float     *_p_r;   // release pointer
-    float      _y_r;   // release interpolation
-    float      _g_r;   // release gain
-    int16_t    _i_r;   // release count
-
-    /**
-     * Allocate memory for the static internal variables _arg (time duringy cycle) _att (attack gain)
-     * @param fsamp Sampling frequency
-     */
-    static void initstatic (float fsamp);
-
-    static   Rngen   _rgen; // for random number generation
-    static   float  *_arg; // time parameter during waveform generation
-    static   float  *_att; // harmonic's attack gain time series
+    int32_t    _slot;  // index in the active voice table, -1 if not active
+    uint64_t   _key;   // generation key, see genkey
+    Wavetab   *_tab;   // shared wavetable holding the samples
+    std::atomic<bool>  _ready{false}; // the descriptor is complete, see ready ()
+    std::atomic<bool>  _want{false};  // keyed before it was ready, to be generated first
 };
 
+struct Genjob;
+class Wavebundle;
+
 /**
  * The class Rankwave defines a rank, which is a set of pipes covering a range of notes (from n0 to n1),
  * voiced in a similar style
@@ -180,16 +377,8 @@ public:
      */
     void note_on (int n)
     {
-
         if ((n < _n0) || (n > _n1)) return;
-        Pipewave *P = _pipes + (n - _n0);
-        P->_sbit = _sbit;
-        if (! (P->_sdel || P->_p_p || P->_p_r))
-        {
-            P->_sdel |= _sbit;
-            P->_link = _list;
-            _list = P;
-        }
+        _voices->note_on (_pipes + (n - _n0), _sbit, _index);
     }
     /** Set midi note to off<br />
      * Note: turning off the note also starts the delay which allows the note to die down without click
@@ -198,17 +387,14 @@ public:
     void note_off (int n)
     {
         if ((n < _n0) || (n > _n1)) return;
-        Pipewave *P = _pipes + (n - _n0);
-        P->_sdel >>= 4;
-        P->_sbit = 0;
+        _voices->note_off (_pipes + (n - _n0));
     }
     /**
      * Turn all the pipes (for all midi notes) of this rank off
      */
     void all_off ()
     {
-        Pipewave *P;
-        for (P = _list; P; P = P->_link) P->_sbit = 0;
+        for (int i = 0; i <= _n1 - _n0; i++) _voices->release (_pipes + i);
     }
     /**
      * Lowest midi note in this rank
@@ -220,52 +406,165 @@ public:
      * @return The highest midi note played by this rank
      */
     [[nodiscard]] int  n1 () const { return _n1; }
-    /**
-     * Play the ranks that are on
-     * @param shift If >0, advance the delay (decay of deactived notes)
-     */
-    void play (int shift);
     /**
      * Set output parameters
+     * @param voices Active voice table of the division, played by Division::process
+     * @param ind Index of the rank in the division
      * @param out Pointer to the output buffer to fill
      * @param del delay, 0 to 31 length of delay
      * @param pan Spatial position of the pipe, for stereo
      */
-    void set_param (float *out, int del, int pan);
+    void set_param (Voicetab *voices, int ind, float *out, int del, int pan);
+    /**
+     * Remove the pipes of this rank from the voice table of its division, so that the rank
+     * can be deleted by another thread. Must be called by the audio thread.
+     */
+    void detach ();
     /** Generate the wavetables for the pipes
      *
      * @param D Additive synthesizer containing the parameters for wavetable synthesis
      * @param fsamp Sampling frequency
      * @param fbase Tuning base frequency
      * @param scale Tuning scale to be applied
+     * @param lmax Maximum loop length, see Pipewave::looplen
+     * @param pool Worker threads over which the pipes are spread, nullptr to generate them in the calling thread
      */
-    void gen_waves (Addsynth *D, float fsamp, float fbase, float *scale);
+    void gen_waves (Addsynth *D, float fsamp, float fbase, float *scale, int lmax, Genpool *pool = nullptr);
     /**
-     * Save the wavetables. This saves the wavetable of each pipe in the rank into a common .ae1 file.
-     * @param path Path to folder for saving wavetables (ae1 files)
-     * @param D Additive synthesizer parameters, here used for the file name
-     * @param fsamp Sampling frequency (checked later when loading from file, must match for wavetable to be used)
-     * @param fbase Base (checked later when loading from file, must match for wavetable to be used)
-     * @param scale (checked later when loading from file, must match for wavetable to be used)
-     * @return 0 on success, 1 on error
+     * Prepare the generation of the wavetables without generating any of them, so that the rank
+     * can be handed to the audio thread at once. The pipes are then generated by gen_some (),
+     * and each one becomes playable as soon as its wavetable is available.
+     * @param D Additive synthesizer containing the parameters for wavetable synthesis
+     * @param fsamp Sampling frequency
+     * @param fbase Tuning base frequency
+     * @param scale Tuning scale to be applied
+     * @param lmax Maximum loop length, see Pipewave::looplen
+     */
+    void gen_init (Addsynth *D, float fsamp, float fbase, float *scale, int lmax);
+    /**
+     * Generate some of the pipes left by gen_init (). Pipes that have been keyed in the meantime
+     * come first, then the others from the middle of the compass outwards.
+     * @param pool Worker threads over which the pipes are spread, nullptr to generate them in the calling thread
+     * @param n Maximum number of pipes to generate
+     * @return The number of pipes still to be generated
+     */
+    int gen_some (Genpool *pool, int n);
+    /**
+     * Is a pipe that is still to be generated keyed
+     * @return true if gen_some () has keyed pipes to do
+     */
+    [[nodiscard]] bool gen_want () const;
+    /**
+     * Predict the memory taken by the wavetables of this rank, before generating them. This leaves
+     * out the random detune of the pipes and the sharing of wavetables between ranks, and is used
+     * by the model to fit the instrument into a memory budget.
+     * @param D Additive synthesizer parameters
+     * @param fsamp Sampling frequency
+     * @param fbase Tuning base frequency
+     * @param scale Tuning scale
+     * @param lmax Maximum loop length, see Pipewave::looplen
+     * @return The size in bytes
+     */
+    size_t wavesize (Addsynth *D, float fsamp, float fbase, float *scale, int lmax);
+    /**
+     * Compute the frequencies of the pipes, taking into account the repetition points
+     * (REPETITION_POINTS) given in the comments of the stop
+     * @param D Additive synthesizer parameters
+     * @param fbase Tuning base frequency
+     * @param scale Tuning scale
+     * @param fp Output, frequency of each pipe from n0 to n1, 0 for pipes that have no valid frequency
+     */
+    void fpipes (Addsynth *D, float fbase, float *scale, float *fp);
+    /**
+     * Compute the playback rate ratios that retune the existing wavetables to a new base frequency
+     * and temperament, as the ratio of the new and the generated pipe frequencies. This only reads
+     * the rank, and is used by the model thread while the rank is playing.
+     * @param D Additive synthesizer parameters
+     * @param fbase New tuning base frequency
+     * @param scale New tuning scale
+     * @param r Output, ratio for each pipe from n0 to n1, 1 for pipes without a valid frequency
+     */
+    void ratios (Addsynth *D, float fbase, float *scale, float *r);
+    /**
+     * Apply playback rate ratios computed by ratios (). Must be called by the audio thread.
+     * Voices keep their position, the new rate takes effect from the next PERIOD on.
+     * @param r Ratio for each pipe from n0 to n1
+     */
+    void retune (const float *r);
+    /**
+     * Copy the wavetables into the image of an .ae1 file of version 2, to be written at a multiple
+     * of AE1_PAGE in a file. The image starts with the headers, followed by an index of the pipes and
+     * by their samples, 64 byte aligned and starting on a page boundary, so that load () can use it
+     * mapped. It is tagged with the tuning the tables were generated for, which is not the current one
+     * if the rank has been retuned by retune (). With WAVE_PACK the samples are compressed, and
+     * decompressed into memory when loaded. The rank is no longer marked as modified afterwards.
+     * @param fsamp Sampling frequency (checked later when loading, must match for the wavetables to be used)
+     * @param size Output, size of the image
+     * @return The image, to be deleted by the caller, see Wavewriter
      */
-    int  save (const char *path, Addsynth *D, float fsamp, float fbase, float *scale);
+    char *image (float fsamp, size_t *size);
 
     /**
-     * Load wavetables into this rank. This causes all the pipes in this rank to load their wavetable
-     * from the common ae1 file.
+     * Load wavetables into this rank. The image of the rank is looked up in the bundle of the instrument
+     * by rankkey (), and the pipes play from its mapping. Otherwise the ae1 file named by cachename () for
+     * the given parameters is used, as written before there were bundles, either keyed or of the earlier
+     * versions named by the stop alone, version 1 or 2: the rank is marked as modified,
+     * so that it moves into the bundle, and the file is deleted once it is there, see oldfile (). If there
+     * is none either, with WAVE_RESAMPLE
+     * the image of the rank at another sample rate is resampled, see loadalt ().
      * @param path Path to the ae1 file folder
      * @param D Additive synthesizer params, here used for the file name
-     * @param fsamp Sampling frequency; loading will only be performed if the sampling frequency matches
+     * @param fsamp Sampling frequency; the image must have been made for it, unless it is resampled
      * @param fbase Base tuning frequency. Loading will onyl be performed if the sampling frequency matches
      * @param scale Tuning scale
+     * @param lmax Maximum loop length, see Pipewave::looplen
+     * @param B Bundle of the instrument, or nullptr
+     * @param pool Workers to decompress the samples with, or nullptr to do it in the calling thread
      * @return 0 upon success, 1 upon failure, including mismatch in fsamp, fbase or scale
      */
-    int  load (const char *path, Addsynth *D, float fsamp, float fbase, float *scale);
+    int  load (const char *path, Addsynth *D, float fsamp, float fbase, float *scale, int lmax, Wavebundle *B = nullptr, Genpool *pool = nullptr);
+    /**
+     * Set the generation keys of the pipes for the given parameters, as load () does first, so that
+     * rankkey () can be used to look up the rank before it is loaded
+     * @param D Additive synthesizer params
+     * @param fsamp Sampling frequency
+     * @param fbase Base tuning frequency
+     * @param scale Tuning scale
+     * @param lmax Maximum loop length, see Pipewave::looplen
+     */
+    void setkeys (Addsynth *D, float fsamp, float fbase, float *scale, int lmax);
+    /**
+     * Key of the wavetables of this rank, a hash of the generation keys of all pipes, so that each voicing,
+     * tuning and sample rate of a stop has one of its own. Valid after setkeys (), load () or gen_init ().
+     * @return The key
+     */
+    [[nodiscard]] uint64_t rankkey () const;
     /** Has this rank been modified compared to the wavetable information on disk?
      * @return True if modified (i.e. wavetables calculated), false if corresponding to file information
      */
     [[nodiscard]] bool modif () const { return _modif; }
+    /**
+     * Take the name of the ae1 file this rank was loaded from, as written before there were bundles.
+     * It is to be deleted once the image of the rank has been saved to the bundle, see Wavewriter.
+     * @return The name, to be deleted by the caller, or nullptr if the rank was not loaded from such a file
+     */
+    [[nodiscard]] char *oldfile () { char *p = _oldfile; _oldfile = nullptr; return p; }
+
+    /**
+     * Generation priorities, in the order in which pending ranks are generated, see gen_some
+     */
+    enum { PRIO_ON, PRIO_BANK, PRIO_OFF };
+    /**
+     * Set the generation priority. This may be called by the model thread while the slave
+     * thread is generating, to move a stop that has just been drawn to the front.
+     * @param p PRIO_ON for a drawn stop, PRIO_BANK for one used by the current preset bank, else PRIO_OFF
+     */
+    void set_prio (int p) { _prio.store (p, std::memory_order_relaxed); }
+    /**
+     * Generation priority
+     * @return The priority, see set_prio
+     */
+    [[nodiscard]] int prio () const { return _prio.load (std::memory_order_relaxed); }
 
     /** Used by division logic. The _cmask is the currently applicable mask for the rank. The lowest 7 bits
      * of the mask code for a maximum of 7 keyboards to which the rank can respond. The rank will play a given note
@@ -287,12 +586,96 @@ private:
     Rankwave (const Rankwave&);
     Rankwave& operator=(const Rankwave&);
 
+    /**
+     * Generate or share the wavetable of one pipe, the work item of gen_some
+     * @param arg The pending generation of the rank
+     * @param n Index in the pipes selected by gen_some
+     */
+    static void gen_pipe (void *arg, int n);
+    /**
+     * Decompress the wavetable of one pipe, the work item of loadmap
+     * @param arg The pipes to decompress
+     * @param n Index in the selected pipes
+     */
+    static void unpack_pipe (void *arg, int n);
+    /**
+     * Resample the wavetable of one pipe, the work item of resample
+     * @param arg The pipes to resample
+     * @param n Index in the selected pipes
+     */
+    static void resample_pipe (void *arg, int n);
+    /**
+     * Name of the wavetable file of this rank, as written before there were bundles. This is the file
+     * name of the stop with rankkey () appended, or, as in the earlier versions, the file name of the
+     * stop alone.
+     * @param name Output, at least 1024 characters
+     * @param path Path to the wavetable folder
+     * @param D Additive synthesizer params, for the file name of the stop
+     * @param keyed True to append rankkey ()
+     */
+    void cachename (char *name, const char *path, Addsynth *D, bool keyed) const;
+    /**
+     * Check the headers of a wavetable image against this rank and the tuning
+     * @param data The image
+     * @param size Size of the image
+     * @param name Name used in the warnings
+     * @param fsamp Sampling frequency
+     * @param fbase Base tuning frequency
+     * @param scale Tuning scale
+     * @return The version of the image, or -1 if it can't be used
+     */
+    int  check (const char *data, size_t size, const char *name, float fsamp, float fbase, float *scale);
+    /**
+     * Load the pipes from a mapped version 2 image, see image (). Compressed pipes are decompressed
+     * in parallel once the others are loaded.
+     * @param M The mapping
+     * @param base Offset of the image in the mapping
+     * @param size Size of the image
+     * @param pool Workers to decompress the samples with, or nullptr
+     * @return 0 on success, 1 on error
+     */
+    int  loadmap (Wavemap *M, size_t base, size_t size, Genpool *pool);
+    /**
+     * Make the wavetables of this rank from those of the same rank at another sampling frequency. The pipes
+     * that are already in memory at the new frequency are shared, the others are resampled in parallel.
+     * This takes a fraction of the time of generating them.
+     * @param S The rank at the old sampling frequency, loaded
+     * @param D Additive synthesizer params
+     * @param fs1 Old sampling frequency
+     * @param fs2 New sampling frequency
+     * @param fbase Base tuning frequency
+     * @param scale Tuning scale
+     * @param lmax Maximum loop length at the new sampling frequency, see Pipewave::looplen
+     * @param pool Workers to resample the pipes with, or nullptr to do it in the calling thread
+     */
+    void resample (Rankwave *S, Addsynth *D, float fs1, float fs2, float fbase, float *scale, int lmax, Genpool *pool);
+    /**
+     * Load the wavetables of this rank from the bundle at another sampling frequency and resample them,
+     * see resample (). The rates of altrates are tried in turn, the canonical rate of 48 kHz first.
+     * The rank is marked as modified, so that it is saved at the current rate.
+     * @param D Additive synthesizer params
+     * @param fsamp Sampling frequency
+     * @param fbase Base tuning frequency
+     * @param scale Tuning scale
+     * @param lmax Maximum loop length, see Pipewave::looplen. It is scaled to the other rates.
+     * @param B Bundle of the instrument
+     * @param pool Workers to decompress and resample with, or nullptr
+     * @return 0 on success, 1 if the rank is not in the bundle at any of the rates
+     */
+    int  loadalt (Addsynth *D, float fsamp, float fbase, float *scale, int lmax, Wavebundle *B, Genpool *pool);
+
     int         _n0; // lowest midi note for the rank
     int         _n1; // Highest midi note for the rank
     uint32_t    _sbit; // Bitmask indicating the starting bit for the delayed plaing cycle
-    Pipewave   *_list; // LIst of active pipes
+    Voicetab   *_voices; // Active voice table of the division
+    int         _index; // Index of the rank in the division
     Pipewave   *_pipes; // Overall array of pipes
     bool        _modif; // is rank modified compared
+    float       _fbase; // tuning base frequency the wavetables were generated for
+    float       _scale [12]; // tuning scale the wavetables were generated for
+    Genjob     *_job; // pending generation, see gen_init
+    char       *_oldfile; // ae1 file the rank was loaded from, see oldfile
+    std::atomic<int>  _prio{PRIO_OFF}; // generation priority, see set_prio
 };
 
 
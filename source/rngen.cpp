@@ -20,6 +20,7 @@
 
 
 #include <cmath>
+#include <cstring>
 #include <ctime>
 #include "rngen.h"
 
@@ -153,3 +154,92 @@ void Rngen::grandf (float *x, float *y)
     *x = r * a;
     *y = r * b;
 }
+
+
+void Rngen::urandf (float *v, int n)
+{
+    int i, j, k;
+
+    while (n)
+    {
+        // Within each of the index ranges 0..23, 24..47 and 48..54 no element
+        // depends on another one of the same range.
+        i = (_i == 54) ? 0 : _i + 1;
+        k = ((i < 24) ? 24 : (i < 48) ? 48 : 55) - i;
+        if (k > n) k = n;
+        if (i < 24) for (j = i; j < i + k; j++) _a [j] += _a [j + 31];
+        else        for (j = i; j < i + k; j++) _a [j] += _a [j - 24];
+        for (j = 0; j < k; j++) v [j] = _a [i + j] / _p32f;
+        _i = i + k - 1;
+        v += k;
+        n -= k;
+    }
+}
+
+
+// Product of two polynomials of degree < 55 modulo x^55 - x^31 - 1,
+// with coefficients modulo 2^32.
+static void polymul (const uint32_t *a, const uint32_t *b, uint32_t *c)
+{
+    int       i, j;
+    uint32_t  t [109];
+
+    memset (t, 0, sizeof (t));
+    for (i = 0; i < 55; i++)
+    {
+        if (! a [i]) continue;
+        for (j = 0; j < 55; j++) t [i + j] += a [i] * b [j];
+    }
+    // x^55 = x^31 + 1
+    for (i = 108; i >= 55; i--)
+    {
+        t [i - 24] += t [i];
+        t [i - 55] += t [i];
+    }
+    memcpy (c, t, 55 * sizeof (uint32_t));
+}
+
+
+void Rngen::jump (uint64_t n)
+{
+    int       i, j;
+    uint32_t  c [55], p [55], x [109], s;
+
+    _md = false;
+    _mf = false;
+    if (n < 256)
+    {
+        while (n--) irand ();
+        return;
+    }
+
+    // c = x^n modulo the characteristic polynomial.
+    memset (c, 0, sizeof (c));
+    memset (p, 0, sizeof (p));
+    c [0] = 1;
+    p [1] = 1;
+    while (n)
+    {
+        if (n & 1) polymul (c, p, c);
+        polymul (p, p, p);
+        n >>= 1;
+    }
+
+    // x [0..54] is the current state, oldest first, followed
+    // by the next 54 values of the sequence.
+    for (i = 0; i < 55; i++) x [i] = _a [(_i + 1 + i) % 55];
+    for (i = 55; i < 109; i++) x [i] = x [i - 55] + x [i - 24];
+    for (i = 0; i < 55; i++)
+    {
+        s = 0;
+        for (j = 0; j < 55; j++) s += c [j] * x [i + j];
+        _a [(_i + 1 + i) % 55] = s;
+    }
+}
+
+
+void Rngen::stream (uint32_t seed, uint32_t k)
+{
+    init (seed);
+    jump ((uint64_t) k << 40);
+}
@@ -109,6 +109,34 @@ public:
      * @return single sample of a uniform random number in the interval 0-1
      */
     float   urandf () { return irand () / _p32f; }
+    /**
+     * Fill an array with uniform random numbers in the interval 0-1. This gives the same values
+     * as n calls to urandf (), but the lagged Fibonacci update is done in runs of up to 24
+     * independent elements, which the compiler vectorizes.
+     * @param v Output array
+     * @param n Number of values
+     */
+    void    urandf (float *v, int n);
+    /**
+     * @brief Advance the generator as if irand () had been called n times
+     *
+     * The recurrence is linear, so the state after n steps is a linear combination of the
+     * current one, with the coefficients of x^n modulo the characteristic polynomial
+     * x^55 - x^31 - 1. These are found by repeated squaring, so the cost grows with log (n).
+     *
+     * @param n Number of steps to skip
+     */
+    void    jump (uint64_t n);
+    /**
+     * @brief Initialize as one of several independent streams from a common seed
+     *
+     * Stream k starts 2^40 values after stream k - 1 of the same seed, so the streams do not
+     * overlap in any realistic use, and each one is reproducible on its own.
+     *
+     * @param seed The common seed, as for init ()
+     * @param k Index of the stream
+     */
+    void    stream (uint32_t seed, uint32_t k);
     /**
      * Normally distributed float random variable
      * @return
@@ -18,18 +18,32 @@
 // ----------------------------------------------------------------------------
 
 
+#include <cstring>
 #include <unistd.h>
 #include "slave.h"
 
 
 void Slave::thr_main ()
 {
+    int      e;
     ITC_mesg *M;
 
-    while (get_event () != EV_EXIT)
+    // Wait for messages, or only check for them while there are pipes to generate or ranks to save or load.
+    while ((e = (_npend || _nsave || _nload) ? get_event_nowait () : get_event ()) != EV_EXIT)
     {
+        if (e == EV_TIME)
+        {
+            if (_nload) load_all ();
+            else if (_nsave) save_all ();
+            else gen_pend ();
+            continue;
+        }
 	M = get_message ();
         if (! M) continue;
+        // The ranks to be saved may be deleted once the next message has been handled.
+        if (_nsave && (M->type () != MT_SAVE_RANK)) save_all ();
+        // Messages are handled in order, the ranks to be loaded come first.
+        if (_nload && (M->type () != MT_LOAD_RANK)) load_all ();
 
         switch (M->type ())
 	{
@@ -38,7 +52,7 @@ void Slave::thr_main ()
                 auto *X = (M_def_rank *) M;
                 send_event (TO_MODEL, new M_ifc_ifelm (MT_IFC_ELATT, X->_group, X->_ifelm)); 
                 X->_wave = new Rankwave (X->_sdef->_n0, X->_sdef->_n1);
-                X->_wave->gen_waves (X->_sdef, X->_fsamp, X->_fbase, X->_scale); 
+                gen_rank (X->_wave, X);
                 send_event (TO_AUDIO, M);
                 break;
 	    }
@@ -49,12 +63,11 @@ void Slave::thr_main ()
                 auto *X = (M_def_rank *) M;
                 send_event (TO_MODEL, new M_ifc_ifelm (MT_IFC_ELATT, X->_group, X->_ifelm)); 
                 X->_wave = new Rankwave (X->_sdef->_n0, X->_sdef->_n1);
-                if (X->_wave->load (X->_path, X->_sdef, X->_fsamp, X->_fbase, X->_scale)) 
-                {
-                    X->_wave->gen_waves (X->_sdef, X->_fsamp, X->_fbase, X->_scale); 
-		        }
-
-                send_event (TO_AUDIO, M);
+                X->_wave->setkeys (X->_sdef, X->_fsamp, X->_fbase, X->_scale, X->_lmax);
+                use_bundle (X->_bundle);
+                _bundle.prefetch (X->_wave->rankkey ());
+                if (_nload == NBATCH) load_all ();
+                _load [_nload++] = X;
                 break;
 	    }
 
@@ -62,14 +75,20 @@ void Slave::thr_main ()
             {
                 __android_log_print(android_LogPriority::ANDROID_LOG_INFO,
                                     "Aeolus Slave", "Saving rank");
-                auto *X = (M_def_rank *) M;
-                X->_wave->save (X->_path, X->_sdef, X->_fsamp, X->_fbase, X->_scale); 
-                M->recover ();
+                if (_nsave == NBATCH) save_all ();
+                _save [_nsave++] = (M_def_rank *) M;
                 break;
 	    }
 
    	    case MT_AUDIO_SYNC:
-		send_event (TO_AUDIO, M);
+		// Passed on by gen_pend () when the pending ranks are done. An older
+		// one still held goes now, the model only acts on the last one.
+		if (_npend)
+		{
+		    if (_sync) send_event (TO_AUDIO, _sync);
+		    _sync = M;
+		}
+		else send_event (TO_AUDIO, M);
 		break;
  
 	    default:
@@ -80,3 +99,119 @@ void Slave::thr_main ()
 }
 
 
+void Slave::gen_rank (Rankwave *W, M_def_rank *M)
+{
+    int        i, k;
+    Rankwave **P;
+    int       *K;
+
+    // Messages are handled in order, so a pending rank in the same place is made
+    // obsolete by this one, which will replace it in the division. It is dropped
+    // here, before the new rank is passed on and the model deletes the old one.
+    k = (M->_divis << 8) | M->_rank;
+    for (i = 0; i < _npend; i++)
+    {
+        if (_pkey [i] == k)
+        {
+            --_npend;
+            _pend [i] = _pend [_npend];
+            _pkey [i] = _pkey [_npend];
+            break;
+        }
+    }
+    W->gen_init (M->_sdef, M->_fsamp, M->_fbase, M->_scale, M->_lmax);
+    W->set_prio (M->_prio);
+    if (_npend == _mpend)
+    {
+        _mpend = 2 * _mpend + 16;
+        P = new Rankwave * [_mpend];
+        K = new int [_mpend];
+        if (_npend)
+        {
+            memcpy (P, _pend, _npend * sizeof (Rankwave *));
+            memcpy (K, _pkey, _npend * sizeof (int));
+        }
+        delete[] _pend;
+        delete[] _pkey;
+        _pend = P;
+        _pkey = K;
+    }
+    _pend [_npend] = W;
+    _pkey [_npend] = k;
+    _npend++;
+}
+
+
+void Slave::gen_pend ()
+{
+    int  i, j, p;
+
+    // A rank with keyed pipes, or else the next one in turn among those of the
+    // highest priority, so that they get their middle pipes before the extremes.
+    // The priorities may be changed by the model thread at any time.
+    for (i = 0; (i < _npend) && ! _pend [i]->gen_want (); i++);
+    if (i == _npend)
+    {
+        p = Rankwave::PRIO_OFF;
+        for (j = 0; j < _npend; j++) if (_pend [j]->prio () < p) p = _pend [j]->prio ();
+        for (j = 0; j < _npend; j++)
+        {
+            i = (_ipend + j) % _npend;
+            if (_pend [i]->prio () <= p) break;
+        }
+    }
+    _ipend = i + 1;
+    if (_pend [i]->gen_some (&_pool, _pool.nthr ())) return;
+    --_npend;
+    _pend [i] = _pend [_npend];
+    _pkey [i] = _pkey [_npend];
+    if (! _npend && _sync)
+    {
+        send_event (TO_AUDIO, _sync);
+        _sync = nullptr;
+    }
+}
+
+
+void Slave::save_all ()
+{
+    int        i;
+    Rankwave  *W [NBATCH];
+
+    gen_all ();
+    for (i = 0; i < _nsave; i++) W [i] = _save [i]->_wave;
+    use_bundle (_save [0]->_bundle);
+    _writer.save (W, _nsave, _save [0]->_fsamp);
+    for (i = 0; i < _nsave; i++) _save [i]->recover ();
+    _nsave = 0;
+}
+
+
+void Slave::load_all ()
+{
+    int         i;
+    M_def_rank  *X;
+
+    for (i = 0; i < _nload; i++)
+    {
+        X = _load [i];
+        use_bundle (X->_bundle);
+        if (X->_wave->load (X->_path, X->_sdef, X->_fsamp, X->_fbase, X->_scale, X->_lmax, &_bundle, &_pool))
+        {
+            gen_rank (X->_wave, X);
+        }
+        send_event (TO_AUDIO, X);
+    }
+    _nload = 0;
+}
+
+
+void Slave::use_bundle (const char *name)
+{
+    // The writer only writes to the file selected when the ranks were queued.
+    if (strcmp (name, _bundle.name ()))
+    {
+        _writer.wait ();
+        _bundle.use (name);
+    }
+}
@@ -24,12 +24,28 @@
 
 #include "../../clthreads/include/clthreads.h"
 #include "messages.h"
+#include "genpool.h"
+#include "wavebundle.h"
+#include "wavewriter.h"
 
 /**
  * Class for separate slave thread for
  * tasks that take a long time: calculating, saving and loading the ranks
  * After starting this thread, it runs a loop in thr_main and waits for cltrhead messages
- * by which it gets instructed to do the rank calculation, saving and loading tasks
+ * by which it gets instructed to do the rank calculation, saving and loading tasks.
+ * A rank to be calculated is handed to the audio thread at once, and its pipes are then
+ * generated in the background whenever there are no messages waiting, keyed pipes first,
+ * by the slave thread and a pool of worker threads. A rank that is replaced by a newer one
+ * before it is complete is dropped, so that repeated retuning or editing only costs the
+ * generation of the last request. The pending ranks are completed before a rank is saved
+ * and before MT_AUDIO_SYNC is passed on, so that the model only saves complete ranks, and
+ * only deletes ranks the slave is done with. The ranks to be saved are collected, and copied
+ * together before any other message is handled, to be written to the wavetable bundle of the
+ * instrument by the writer thread, see Wavewriter.
+ * Likewise the ranks to be loaded are collected while messages keep coming, and their images
+ * in the bundle read ahead in the background, so that the disk reads of the later ones overlap
+ * with the unpacking and generation of the earlier ones. Each rank goes to the audio thread as
+ * soon as it is loaded.
  */
 class Slave : public A_thread
 {
@@ -37,22 +53,69 @@ public:
     /**
      * Constructur
      */
-    Slave () : A_thread ("Slave") {}
+    Slave () : A_thread ("Slave"), _pend (nullptr), _pkey (nullptr), _npend (0), _mpend (0), _ipend (0), _sync (nullptr), _writer (&_bundle), _nsave (0), _nload (0) {}
     /**
      * Destructor
      */
-    virtual ~Slave () {}
+    virtual ~Slave () { delete[] _pend; delete[] _pkey; }
     /**
      * Terminate, including sending the termination message to all other threads
      */
     void terminate () {  put_event (EV_EXIT, 1); }
 
 private:
+
+    enum { NBATCH = 256 }; // ranks saved or loaded in one go
+
     /**
      * Main thread routing. This is the looping routing waiting for the messages
      * to be handled
      */
      void thr_main () override;
+     /**
+      * Start the background generation of a rank, see Rankwave::gen_init
+      * @param W The rank
+      * @param M The message that defines the rank
+      */
+     void gen_rank (Rankwave *W, M_def_rank *M);
+     /**
+      * Generate one batch of pipes of the pending ranks, preferring a rank with keyed pipes,
+      * then the ranks of the highest priority, see Rankwave::set_prio
+      */
+     void gen_pend ();
+     /**
+      * Generate all pending pipes
+      */
+     void gen_all () { while (_npend) gen_pend (); }
+     /**
+      * Hand the ranks of the collected MT_SAVE_RANK messages to the writer thread in one go,
+      * and give back the messages
+      */
+     void save_all ();
+     /**
+      * Load the ranks of the collected MT_LOAD_RANK messages, or start their generation if they
+      * can't be loaded, and pass them on to the audio thread one by one
+      */
+     void load_all ();
+     /**
+      * Select the bundle file of the instrument, waiting for the writer if it is another one
+      * @param name Path of the file
+      */
+     void use_bundle (const char *name);
+
+     Genpool    _pool; // workers for the wavetable generation
+     Rankwave **_pend; // ranks with pipes still to be generated
+     int       *_pkey; // division and index of each pending rank
+     int        _npend; // number of pending ranks
+     int        _mpend; // allocated pending ranks
+     int        _ipend; // next pending rank in turn
+     ITC_mesg  *_sync; // MT_AUDIO_SYNC held until the pending ranks are done
+     Wavebundle  _bundle; // wavetable bundle of the instrument
+     Wavewriter  _writer; // writer thread for the bundle
+     M_def_rank *_save [NBATCH]; // ranks to be saved
+     int        _nsave; // number of ranks to be saved
+     M_def_rank *_load [NBATCH]; // ranks to be loaded, read ahead
+     int        _nload; // number of ranks to be loaded
 };
 
 
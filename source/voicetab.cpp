@@ -0,0 +1,339 @@
+// ----------------------------------------------------------------------------
+//
+//  This program is free software; you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation; either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  This program is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+// ----------------------------------------------------------------------------
+
+
+#include "voicetab.h"
+#include "rankwave.h"
+
+
+Voicetab::Voicetab (int size, int stream) :
+    _size (size),
+    _nvoice (0),
+    _nskip (0),
+    _nkill (0)
+{
+    _pipe = new Pipewave * [size];
+    _rank = new int16_t [size];
+    _out  = new float * [size];
+    _sbit = new uint32_t [size];
+    _sdel = new uint32_t [size];
+    _p_p  = new wave_t * [size];
+    _y_p  = new float [size];
+    _z_p  = new float [size];
+    _p_r  = new wave_t * [size];
+    _y_r  = new float [size];
+    _g_r  = new float [size];
+    _i_r  = new int16_t [size];
+    _rnd  = new float [size];
+    // A fixed seed, so that the instability is the same on every run.
+    _rgen.stream (0x5eed, stream);
+}
+
+
+Voicetab::~Voicetab ()
+{
+    delete[] _pipe;
+    delete[] _rank;
+    delete[] _out;
+    delete[] _sbit;
+    delete[] _sdel;
+    delete[] _p_p;
+    delete[] _y_p;
+    delete[] _z_p;
+    delete[] _p_r;
+    delete[] _y_r;
+    delete[] _g_r;
+    delete[] _i_r;
+    delete[] _rnd;
+}
+
+
+void Voicetab::note_on (Pipewave *P, uint32_t sbit, int rank)
+{
+    int i;
+
+    if (P->_slot >= 0)
+    {
+        // Still sounding or releasing: as in the former linked list version, only
+        // the on state bit is renewed, the delay line takes care of the rest.
+        _sbit [P->_slot] = sbit;
+        return;
+    }
+    if (_nvoice == _size) return;
+    // A pipe that is not generated yet gets a silent voice, which starts to
+    // sound if the wavetable arrives while the key is still down.
+    if (! P->ready ()) P->_want.store (true, std::memory_order_relaxed);
+    i = _nvoice++;
+    P->_slot = i;
+    _pipe [i] = P;
+    _rank [i] = (int16_t) rank;
+    _out [i]  = P->_out;
+    _sbit [i] = sbit;
+    _sdel [i] = sbit;
+    _p_p [i]  = nullptr;
+    _y_p [i]  = 0.0f;
+    _z_p [i]  = 0.0f;
+    _p_r [i]  = nullptr;
+    _y_r [i]  = 0.0f;
+    _g_r [i]  = 0.0f;
+    _i_r [i]  = 0;
+}
+
+
+void Voicetab::note_off (Pipewave *P)
+{
+    if (P->_slot < 0) return;
+    _sdel [P->_slot] >>= 4;
+    _sbit [P->_slot] = 0;
+}
+
+
+void Voicetab::release (Pipewave *P)
+{
+    if (P->_slot < 0) return;
+    _sbit [P->_slot] = 0;
+}
+
+
+void Voicetab::detach (Pipewave *P)
+{
+    if (P->_slot >= 0) remove (P->_slot);
+}
+
+
+void Voicetab::remove (int i)
+{
+    int k;
+
+    _pipe [i]->_slot = -1;
+    k = --_nvoice;
+    if (i == k) return;
+    _pipe [i] = _pipe [k];
+    _rank [i] = _rank [k];
+    _out [i]  = _out [k];
+    _sbit [i] = _sbit [k];
+    _sdel [i] = _sdel [k];
+    _p_p [i]  = _p_p [k];
+    _y_p [i]  = _y_p [k];
+    _z_p [i]  = _z_p [k];
+    _p_r [i]  = _p_r [k];
+    _y_r [i]  = _y_r [k];
+    _g_r [i]  = _g_r [k];
+    _i_r [i]  = _i_r [k];
+    _rnd [i]  = _rnd [k];
+    _pipe [i]->_slot = i;
+}
+
+
+int Voicetab::nactive () const
+{
+    int i, n;
+
+    for (i = n = 0; i < _nvoice; i++) if (! fading (i)) n++;
+    return n;
+}
+
+
+int Voicetab::quietest (float *g) const
+{
+    int i, j;
+
+    j = -1;
+    for (i = 0; i < _nvoice; i++)
+    {
+        if (fading (i) || _p_p [i] || ! _p_r [i] || (_sdel [i] & 1)) continue;
+        if ((j < 0) || (_g_r [i] < _g_r [j])) j = i;
+    }
+    if (j >= 0) *g = _g_r [j];
+    return j;
+}
+
+
+int Voicetab::steal (int n)
+{
+    int i, j, k;
+
+    for (k = 0; k < n; k++)
+    {
+        j = -1;
+        for (i = 0; i < _nvoice; i++)
+        {
+            if (fading (i) || (_p_p [i] && _p_r [i])) continue;
+            if ((j < 0) || (_rank [i] > _rank [j])) j = i;
+        }
+        if (j < 0) break;
+        fade (j);
+    }
+    return k;
+}
+
+
+void Voicetab::fade (int i)
+{
+    if (! _p_r [i])
+    {
+        // Still on, or in the delay before starting: release from the play position.
+        _p_r [i] = _p_p [i];
+        _y_r [i] = _y_p [i];
+        _g_r [i] = 1.0f;
+    }
+    _p_p [i] = nullptr;
+    _sdel [i] = 0;
+    _sbit [i] = 0;
+    // With a count of one, play () uses a linear fade over the PERIOD and then ends the voice.
+    _i_r [i] = 1;
+}
+
+
+void Voicetab::play (float gain, float thr)
+{
+    int i;
+
+    _rgen.urandf (_rnd, _nvoice);
+    i = 0;
+    while (i < _nvoice)
+    {
+        if (_pipe [i]->ready ()) play (i, gain * _pipe [i]->_peak, thr);
+        _sdel [i] = (_sdel [i] >> 1) | _sbit [i];
+        // A finished voice is replaced by the last one, which has not been
+        // played yet in this period, so i is not advanced in that case.
+        if (_sdel [i] || _p_p [i] || _p_r [i]) i++;
+        else remove (i);
+    }
+}
+
+
+void Voicetab::play (int i, float a, float thr)
+{
+    int       j, k;
+    float     g, dg, s;
+    float     *q;
+    wave_t    *p, *r;
+    Pipewave  *P;
+
+    P = _pipe [i];
+    p = _p_p [i]; // copy of the play head pointer
+    r = _p_r [i]; // copy of the release data pointer
+
+    if (_sdel [i] & 1) // delayed state means we are playing the main note
+    {
+        if (! p) // We have no valid play pointer, start at the beginning of the wave table
+        {
+            p = P->_p0;
+            _y_p [i] = 0.0f;
+            _z_p [i] = 0.0f;
+        }
+    }
+    else
+    {
+        if (! r) // otherwise, we are releasing the note
+        {
+            r = p; // if we have no release pointer at this point, set to the current play pointer
+            p = nullptr; // not playing anymore
+            _g_r [i] = 1.0f;
+            _y_r [i] = _y_p [i];
+            _i_r [i] = P->_k_r;
+        }
+    }
+
+    if (r && (r >= P->_p1) && (a * _g_r [i] < thr) && (_i_r [i] > 1))
+    {
+        // Release tail below the threshold, faded out within this period, see fade ().
+        // If the pipe has been restarted meanwhile only its release is cut short.
+        if (p || _sdel [i] || _sbit [i]) _i_r [i] = 1;
+        else
+        {
+            _p_r [i] = r;
+            fade (i);
+        }
+        _nkill++;
+    }
+
+    if (r) // Doing the release (this is an exponential to avoid a clack when suddenly stopping
+    {
+        k = PERIOD;
+        q = _out [i];
+        g = _g_r [i];
+        j = _i_r [i] - 1;
+        dg = g / PERIOD;
+        if (j) dg *= P->_m_r;
+
+        if ((r < P->_p1) && (P->_ratio == 1.0f) && (_y_r [i] == 0.0f)) // release while still in attack phase
+        {
+            s = P->_scale;
+            while (k--) // go on sampling with decreasing transfer gain
+            {
+                *q++ += g * s * *r++;
+                g -= dg;
+            }
+        }
+        else if (r < P->_p1)
+        {
+            // The same for a retuned pipe, which needs to interpolate,
+            // or for one that has been retuned back during the attack
+            r = P->attack (r, _y_r + i, P->_d_r + P->_d_t, q, g, dg);
+            g -= PERIOD * dg;
+        }
+        else
+        {
+            // Go on sampling during release but at possible different rate
+            r = P->loop (r, _y_r + i, P->_d_r + P->_d_t, q, g, dg);
+            g -= PERIOD * dg;
+        }
+
+        if (j)
+        {
+            _g_r [i] = g;
+            _i_r [i] = j;
+        }
+        else r = nullptr;
+    }
+
+    if (p) // We're playing
+    {
+        k = PERIOD;
+        q = _out [i];
+        if ((p < P->_p1) && (P->_ratio == 1.0f) && (_y_p [i] == 0.0f))
+        {
+            s = P->_scale;
+            while (k--)
+            {
+                *q++ += s * *p++;
+            }
+        }
+        else if (p < P->_p1)
+        {
+            // Retuned pipe, interpolate the attack at the new rate, see above
+            p = P->attack (p, _y_p + i, _z_p [i] * P->step () + P->_d_t, q, 1.0f, 0.0f);
+        }
+        else
+        {
+            _z_p [i] += P->_d_p * 0.0005f * (0.05f * P->_d_p * (_rnd [i] - 0.5f) - _z_p [i]);
+            // The detune is the instability plus the retuning, if any.
+            if (a < thr)
+            {
+                // Inaudible, only keep the position going.
+                p = P->skip (p, _y_p + i, _z_p [i] * P->step () + P->_d_t);
+                _nskip++;
+            }
+            else p = P->loop (p, _y_p + i, _z_p [i] * P->step () + P->_d_t, q, 1.0f, 0.0f); // interpolate and put into output
+        }
+    }
+
+    _p_p [i] = p; // For the next round
+    _p_r [i] = r; // for the next round
+}
@@ -0,0 +1,175 @@
+// ----------------------------------------------------------------------------
+//
+//  This program is free software; you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation; either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  This program is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+// ----------------------------------------------------------------------------
+
+
+#ifndef AEOLUS_VOICETAB_H
+#define AEOLUS_VOICETAB_H
+
+
+#include <cstdint>
+#include "rngen.h"
+#include "wavekern.h"
+
+
+class Pipewave;
+
+
+/**
+ * Table of the active voices (sounding or releasing pipes) of a division.<br /><br />
+ * The play state of the voices is held in structure-of-arrays form, separate from the
+ * wavetable descriptors in Pipewave, which are only read during playback. Voice i is
+ * described by entry i of each array. The active voices are kept at the start of the
+ * arrays: a voice that has finished is replaced by the last one, so that one period
+ * is a single pass over _nvoice contiguous entries.<br />
+ * A pipe knows its entry through Pipewave::_slot, which is -1 while the pipe is silent.
+ */
+class Voicetab
+{
+public:
+    /**
+     * Constructor, allocates the arrays for a fixed maximum number of voices
+     * @param size Maximum number of simultaneously active voices
+     * @param stream Index of the random number stream used for the pitch instability,
+     *               see Rngen::stream. Tables with different indices are independent.
+     */
+    Voicetab (int size, int stream);
+    ~Voicetab ();
+
+    /**
+     * Start a pipe, or keep it sounding if it is still active
+     * @param P The pipe
+     * @param sbit On state bit of the rank, see Rankwave::set_param
+     * @param rank Index of the rank in the division, higher indices are stolen first
+     */
+    void note_on (Pipewave *P, uint32_t sbit, int rank);
+    /**
+     * Stop a pipe. The pipe continues to sound for the delay of its rank and then releases.
+     * @param P The pipe
+     */
+    void note_off (Pipewave *P);
+    /**
+     * Clear the on state bit of a pipe, so that it stops once its delay line has run out.
+     * Unlike note_off, the part of the delay line already filled is kept.
+     * @param P The pipe
+     */
+    void release (Pipewave *P);
+    /**
+     * Remove a pipe from the table immediately, without release. Used when its rank is deleted.
+     * @param P The pipe
+     */
+    void detach (Pipewave *P);
+    /**
+     * Play one PERIOD of all the active voices into their output buffers, advance their
+     * delay state and remove the voices that have finished.<br />
+     * Voices that are inaudible are culled: the audibility of a voice is estimated as the
+     * peak level of its pipe times its release gain times the gain that follows in the
+     * signal chain. A sounding pipe below the threshold is not rendered, but its read
+     * position is advanced so that it continues seamlessly when the gain comes back up.
+     * A release below the threshold is faded out within one period, see fade ().<br />
+     * The random values driving the pitch instability are drawn for all voices at once.
+     * @param gain Upper bound of the gain applied to the output buffers (division and global volume)
+     * @param thr Audibility threshold, 0 to disable culling
+     */
+    void play (float gain, float thr);
+    /**
+     * Number of active voices
+     * @return The number of voices in the table
+     */
+    [[nodiscard]] int nvoice () const { return _nvoice; }
+    /**
+     * Number of voices that still count against the voice budget, i.e. all except
+     * those in their final period and those that never started
+     * @return The number of voices not yet fading out
+     */
+    [[nodiscard]] int nactive () const;
+    /**
+     * Voice stealing: find the quietest releasing voice, the one with the lowest release gain.
+     * A pipe that was restarted while its release is still going on is not taken.
+     * @param g Output, the release gain of the voice found
+     * @return Index of the voice, to be passed to fade (), or -1 if there is none
+     */
+    int quietest (float *g) const;
+    /**
+     * Voice stealing: fade out up to n voices within the next PERIOD, sounding pipes as well as
+     * releasing ones, starting with the rank with the highest index.
+     * A pipe that was restarted while its release is still going on is never stolen.
+     * @param n Number of voices to fade out
+     * @return The number of voices actually stolen
+     */
+    int steal (int n);
+    /**
+     * Force voice i into its last release period, a linear fade to zero
+     * @param i Index of the voice
+     */
+    void fade (int i);
+    /**
+     * Culling statistics: number of voice periods that were not rendered
+     * @return Counter, wraps around
+     */
+    [[nodiscard]] uint32_t nskip () const { return _nskip; }
+    /**
+     * Culling statistics: number of releases that were ended early
+     * @return Counter, wraps around
+     */
+    [[nodiscard]] uint32_t nkill () const { return _nkill; }
+
+private:
+
+    Voicetab (const Voicetab&);
+    Voicetab& operator=(const Voicetab&);
+
+    /**
+     * Play one PERIOD of voice i, see Pipewave::loop for the loop section
+     * @param i Index of the voice
+     * @param a Audibility of the voice at full gain, see play (float, float)
+     * @param thr Audibility threshold
+     */
+    void play (int i, float a, float thr);
+    /**
+     * Remove voice i, moving the last voice into its place
+     * @param i Index of the voice
+     */
+    void remove (int i);
+    /**
+     * Is voice i in its last period, or not started at all
+     * @param i Index of the voice
+     * @return true if the voice ends within the current PERIOD
+     */
+    [[nodiscard]] bool fading (int i) const { return ! (_sdel [i] || _p_p [i]) && (_i_r [i] <= 1); }
+
+    int          _size;   // capacity
+    int          _nvoice; // number of active voices
+    uint32_t     _nskip;  // voice periods not rendered
+    uint32_t     _nkill;  // releases ended early
+    Pipewave   **_pipe;   // wavetable descriptor
+    int16_t     *_rank;   // rank index in the division, for voice stealing
+    float      **_out;    // audio output buffer
+    uint32_t    *_sbit;   // on state bit
+    uint32_t    *_sdel;   // delayed state
+    wave_t     **_p_p;    // play pointer
+    float       *_y_p;    // play interpolation
+    float       *_z_p;    // play interpolation speed
+    wave_t     **_p_r;    // release pointer
+    float       *_y_r;    // release interpolation
+    float       *_g_r;    // release gain
+    int16_t     *_i_r;    // release count
+    float       *_rnd;    // random values for the instability, one per voice and period
+    Rngen        _rgen;   // random number stream of this table
+};
+
+
+#endif
@@ -0,0 +1,382 @@
+// ----------------------------------------------------------------------------
+//
+//  This program is free software; you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation; either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  This program is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+// ----------------------------------------------------------------------------
+
+
+#include <cstdio>
+#include <cstring>
+#include <algorithm>
+#include <android/log.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "wavebundle.h"
+#include "rankwave.h"
+
+#ifndef CACHE_SIZE // Maximum size of the wavetable bundle of an instrument in MB, the least recently saved ranks are dropped beyond it
+# define CACHE_SIZE 256
+#endif
+
+extern int isDirectoryExists (const char *path);
+
+
+// File layout: a 64 byte header with the tag "aeb", the version, the offset and number of
+// the entries of the table of contents and the last sequence number, then the images of the
+// ranks at multiples of AE1_PAGE, and the table of contents, 32 bytes per entry.
+
+
+Wavebundle::Wavebundle () : _map (nullptr), _toc (nullptr), _ntoc (0), _seq (0)
+{
+    _name [0] = 0;
+}
+
+
+Wavebundle::~Wavebundle ()
+{
+    close ();
+}
+
+
+void Wavebundle::use (const char *name)
+{
+    if (! strcmp (name, _name)) return;
+    _mutex.lock ();
+    close ();
+    snprintf (_name, 1024, "%s", name);
+    _mutex.unlock ();
+}
+
+
+int Wavebundle::open ()
+{
+    int          i;
+    int32_t      n;
+    int64_t      t;
+    const char   *d;
+
+    close ();
+    if (! *_name || ! (_map = Wavemap::open (_name))) return 1;
+    d = _map->data ();
+    n = 0;
+    t = 0;
+    if ((_map->size () >= 64) && ! strcmp (d, "aeb") && (d [4] == 1))
+    {
+        memcpy (&t, d + 8, sizeof (t));
+        memcpy (&n, d + 16, sizeof (n));
+        memcpy (&_seq, d + 20, sizeof (_seq));
+    }
+    if ((t < 64) || (n < 0) || ((size_t) t + 32 * (size_t) n > _map->size ()))
+    {
+        __android_log_print(android_LogPriority::ANDROID_LOG_WARN,
+                            "Wavebundle", "File '%s' is not a valid wavetable bundle", _name);
+        close ();
+        return 1;
+    }
+    _toc = new Entry [n];
+    for (i = 0; i < n; i++)
+    {
+        Entry *E = _toc + _ntoc;
+        d = _map->data () + t + 32 * i;
+        memcpy (&E->key,  d,      sizeof (E->key));
+        memcpy (&E->offs, d + 8,  sizeof (E->offs));
+        memcpy (&E->size, d + 16, sizeof (E->size));
+        memcpy (&E->seq,  d + 24, sizeof (E->seq));
+        E->used = 0;
+        if ((E->offs >= 64) && (E->size > 0) && (E->offs + E->size <= t)) _ntoc++;
+    }
+    return 0;
+}
+
+
+void Wavebundle::close ()
+{
+    if (_map) _map->release ();
+    _map = nullptr;
+    delete[] _toc;
+    _toc = nullptr;
+    _ntoc = 0;
+    _seq = 0;
+}
+
+
+Wavemap *Wavebundle::find (uint64_t key, size_t *base, size_t *size)
+{
+    int       i;
+    Wavemap  *M;
+
+    M = nullptr;
+    _mutex.lock ();
+    if (_map || ! open ())
+    {
+        for (i = 0; i < _ntoc; i++)
+        {
+            if (_toc [i].key == key)
+            {
+                _toc [i].used = 1;
+                *base = _toc [i].offs;
+                *size = _toc [i].size;
+                _map->acquire ();
+                M = _map;
+                break;
+            }
+        }
+    }
+    _mutex.unlock ();
+    return M;
+}
+
+
+void Wavebundle::prefetch (uint64_t key)
+{
+    int  i;
+
+    _mutex.lock ();
+    if (_map || ! open ())
+    {
+        for (i = 0; i < _ntoc; i++)
+        {
+            if (_toc [i].key == key)
+            {
+                _map->prefetch (_toc [i].offs, _toc [i].size);
+                break;
+            }
+        }
+    }
+    _mutex.unlock ();
+}
+
+
+int Wavebundle::save (const Image *I, int n)
+{
+    static const char zero [AE1_PAGE] = { 0 };
+
+    FILE      *F;
+    Entry     *E;
+    int        i, j, k;
+    int64_t    offs;
+    uint32_t   seq;
+    bool       add;
+    char       path [1024];
+    char       temp [1040];
+    char       *p;
+
+    if (! *_name) return 1;
+    snprintf (path, 1024, "%s", _name);
+    if ((p = strrchr (path, '/')))
+    {
+        *p = 0;
+        if (! isDirectoryExists (path)) mkdir (path, 0777);
+    }
+
+    // Appended to the existing file, or a new one. The new table of contents is built aside,
+    // the current one stays in use until the file is complete. A new file is written to a
+    // temporary one that then replaces the old, which may still be mapped by the ranks loaded
+    // from it even if it could not be opened again, so it is never truncated.
+    _mutex.lock ();
+    if (! _map) open ();
+    add = _map != nullptr;
+    E = new Entry [_ntoc + n];
+    k = _ntoc;
+    if (k) memcpy (E, _toc, k * sizeof (Entry));
+    seq = _seq + 1;
+    _mutex.unlock ();
+    snprintf (temp, sizeof (temp), "%s.tmp", _name);
+    F = add ? fopen (_name, "r+b") : fopen (temp, "w+b");
+    if (F == nullptr)
+    {
+        __android_log_print(android_LogPriority::ANDROID_LOG_ERROR,
+                            "Wavebundle", "Can't open wavetable bundle '%s' for writing", _name);
+        delete[] E;
+        return 1;
+    }
+    // The header is written last, see finish ().
+    if (! add) fwrite (zero, 1, 64, F);
+    fseek (F, 0, SEEK_END);
+
+    for (i = 0; i < n; i++)
+    {
+        offs = ftell (F);
+        fwrite (zero, 1, (-offs) & (AE1_PAGE - 1), F);
+        offs = (offs + AE1_PAGE - 1) & ~(int64_t)(AE1_PAGE - 1);
+        if (fwrite (I [i].data, 1, I [i].size, F) != I [i].size) break;
+        // A new image of a rank replaces the old one.
+        for (j = 0; (j < k) && (E [j].key != I [i].key); j++);
+        if (j == k) k++;
+        E [j].key = I [i].key;
+        E [j].offs = offs;
+        E [j].size = I [i].size;
+        E [j].seq = seq;
+        E [j].used = 1;
+    }
+    if ((i < n) | finish (F, E, k, seq) | fclose (F) | (! add && rename (temp, _name)))
+    {
+        __android_log_print(android_LogPriority::ANDROID_LOG_ERROR,
+                            "Wavebundle", "Can't write wavetable bundle '%s'", _name);
+        if (! add) unlink (temp);
+        delete[] E;
+        // Remapped, whatever is left of the file.
+        _mutex.lock ();
+        close ();
+        _mutex.unlock ();
+        return 1;
+    }
+
+    // The mapping is renewed to include the new images, the tables keep the old one.
+    replace (E, k, Wavemap::open (_name), seq);
+    compact ();
+    return 0;
+}
+
+
+int Wavebundle::finish (FILE *F, const Entry *E, int n, uint32_t seq)
+{
+    int      i;
+    int64_t  t;
+    char     d [64];
+
+    for (t = ftell (F); t % 64; t++) fputc (0, F);
+    for (i = 0; i < n; i++)
+    {
+        memset (d, 0, 32);
+        memcpy (d,      &E [i].key,  sizeof (E [i].key));
+        memcpy (d + 8,  &E [i].offs, sizeof (E [i].offs));
+        memcpy (d + 16, &E [i].size, sizeof (E [i].size));
+        memcpy (d + 24, &E [i].seq,  sizeof (E [i].seq));
+        fwrite (d, 1, 32, F);
+    }
+    // Everything else is on the disk before the header points to it.
+    fflush (F);
+    fsync (fileno (F));
+    memset (d, 0, 64);
+    strcpy (d, "aeb");
+    d [4] = 1;
+    memcpy (d + 8, &t, sizeof (t));
+    memcpy (d + 16, &n, sizeof (int32_t));
+    memcpy (d + 20, &seq, sizeof (seq));
+    fseek (F, 0, SEEK_SET);
+    fwrite (d, 1, 64, F);
+    fflush (F);
+    return ferror (F) ? 1 : 0;
+}
+
+
+void Wavebundle::replace (Entry *E, int n, Wavemap *M, uint32_t seq)
+{
+    int  i, j;
+
+    _mutex.lock ();
+    if (M)
+    {
+        // Ranks found by the slave thread meanwhile.
+        for (i = 0; i < n; i++)
+        {
+            for (j = 0; (j < _ntoc) && (_toc [j].key != E [i].key); j++);
+            if (j < _ntoc) E [i].used |= _toc [j].used;
+        }
+        if (_map) _map->release ();
+        _map = M;
+        delete[] _toc;
+        _toc = E;
+        _ntoc = n;
+        _seq = seq;
+    }
+    else
+    {
+        delete[] E;
+        close ();
+    }
+    _mutex.unlock ();
+}
+
+
+void Wavebundle::compact ()
+{
+    FILE      *F;
+    Entry     *E;
+    Wavemap   *M;
+    int        i, k, n;
+    int64_t    live, drop, offs;
+    uint32_t   seq;
+    char       temp [1040];
+
+    _mutex.lock ();
+    if (! (M = _map))
+    {
+        _mutex.unlock ();
+        return;
+    }
+    M->acquire ();
+    n = _ntoc;
+    E = new Entry [n];
+    memcpy (E, _toc, n * sizeof (Entry));
+    seq = _seq;
+    _mutex.unlock ();
+
+    // The ranks in use first, then the most recently saved ones.
+    std::sort (E, E + n, [] (const Entry &a, const Entry &b)
+    {
+        return (a.used != b.used) ? (a.used > b.used) : (a.seq > b.seq);
+    });
+
+    // Only rewritten if that reclaims space: the images of the ranks not in use beyond CACHE_SIZE,
+    // or the dead images, once they take as much space as the others. The ranks in use are kept
+    // even if they exceed CACHE_SIZE by themselves.
+    live = drop = 0;
+    for (i = 0; i < n; i++)
+    {
+        if (! E [i].used && (live + E [i].size > ((int64_t) CACHE_SIZE << 20))) drop += E [i].size;
+        else live += E [i].size;
+    }
+    if (! drop && ((int64_t) M->size () <= 2 * live + (int64_t) AE1_PAGE * (n + 2)))
+    {
+        M->release ();
+        delete[] E;
+        return;
+    }
+
+    // Written to a temporary file that then replaces the old one, which is mapped.
+    snprintf (temp, sizeof (temp), "%s.tmp", _name);
+    if ((F = fopen (temp, "wb")))
+    {
+        for (i = 0; i < 64; i++) fputc (0, F);
+        live = 0;
+        for (i = k = 0; i < n; i++)
+        {
+            if (! E [i].used && (live + E [i].size > ((int64_t) CACHE_SIZE << 20))) continue;
+            for (offs = ftell (F); offs % AE1_PAGE; offs++) fputc (0, F);
+            fwrite (M->data () + E [i].offs, 1, E [i].size, F);
+            live += E [i].size;
+            E [k] = E [i];
+            E [k++].offs = offs;
+        }
+        if (finish (F, E, k, seq) | fclose (F) | rename (temp, _name))
+        {
+            __android_log_print(android_LogPriority::ANDROID_LOG_ERROR,
+                                "Wavebundle", "Can't rewrite wavetable bundle '%s'", _name);
+            unlink (temp);
+            F = nullptr;
+        }
+    }
+    M->release ();
+    if (! F)
+    {
+        // The old file is still complete.
+        delete[] E;
+        return;
+    }
+    __android_log_print(android_LogPriority::ANDROID_LOG_INFO,
+                        "Wavebundle", "Rewritten '%s', %d ranks", _name, k);
+    replace (E, k, Wavemap::open (_name), seq);
+}
@@ -0,0 +1,152 @@
+// ----------------------------------------------------------------------------
+//
+//  This program is free software; you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation; either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  This program is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+// ----------------------------------------------------------------------------
+
+
+#ifndef AEOLUS_WAVEBUNDLE_H
+#define AEOLUS_WAVEBUNDLE_H
+
+
+#include <cstdint>
+#include <cstdio>
+#include "wavetab.h"
+
+
+/**
+ * Wavetable bundle of an instrument (.aeb file).<br /><br />
+ * One file holds the wavetables of all ranks of an instrument, each as the image of an .ae1
+ * version 2 file (see Rankwave::image), page aligned, and a table of contents with the rank key
+ * (see Rankwave::rankkey), offset and size of each image. It is mapped as a whole, so loading
+ * the ranks of an instrument takes a single open and mmap, see Rankwave::load.<br />
+ * save () appends the images of the ranks that have changed, followed by a new table of
+ * contents, and then updates the header, so that the file stays valid if it is interrupted,
+ * and images that are mapped are never overwritten. If there is no valid file to append to, a new
+ * one is written aside and renamed over the old one, as when it is rewritten. Replaced images are
+ * dropped when the file is rewritten, once they take as much space as the others, or once there
+ * are images of ranks not in use beyond CACHE_SIZE. The ranks in use are always kept.<br />
+ * prefetch () lets the kernel read the images of the ranks about to be loaded in the background,
+ * while the ones before are unpacked or generated.<br />
+ * A bundle is used by the slave thread, and saved by the writer thread, see Wavewriter. The new
+ * mapping and table of contents replace the old ones only once the file is complete, under a
+ * mutex, so that the slave thread can load ranks meanwhile. use () is only called while no save
+ * is in progress.
+ */
+class Wavebundle
+{
+public:
+
+    /**
+     * Image of a rank to be saved, see Rankwave::image
+     */
+    struct Image
+    {
+        uint64_t  key;   // rank key
+        char     *data;  // the image
+        size_t    size;  // its size
+        char     *file;  // ae1 file of the rank as written before there were bundles, or nullptr, see Wavewriter
+    };
+
+    Wavebundle ();
+    ~Wavebundle ();
+
+    /**
+     * Select the bundle file, closing the previous one if it is another file
+     * @param name Path of the file
+     */
+    void use (const char *name);
+    /**
+     * Path of the selected file
+     * @return The path, empty if none
+     */
+    [[nodiscard]] const char *name () const { return _name; }
+    /**
+     * Look up the image of a rank, mapping the file if it is not mapped yet
+     * @param key Rank key
+     * @param base Output, offset of the image in the mapping
+     * @param size Output, size of the image
+     * @return The mapping with a reference for the caller, or nullptr if the rank is not in the bundle
+     */
+    Wavemap *find (uint64_t key, size_t *base, size_t *size);
+    /**
+     * Start reading the image of a rank in the background, if it is in the bundle, so that
+     * it is in memory when find () and the pipes use it
+     * @param key Rank key
+     */
+    void prefetch (uint64_t key);
+    /**
+     * Add or replace the images of ranks
+     * @param I The images
+     * @param n Number of images
+     * @return 0 on success, 1 on error
+     */
+    int save (const Image *I, int n);
+
+private:
+
+    Wavebundle (const Wavebundle&);
+    Wavebundle& operator=(const Wavebundle&);
+
+    // Entry of the table of contents, 32 bytes in the file.
+    struct Entry
+    {
+        uint64_t  key;   // rank key
+        int64_t   offs;  // offset of the image
+        int64_t   size;  // size of the image
+        uint32_t  seq;   // save () that wrote it, for the cache order
+        uint32_t  used;  // found or saved since the file was selected, not in the file
+    };
+
+    /**
+     * Map the file and read the table of contents
+     * @return 0 on success, 1 if there is no valid file
+     */
+    int open ();
+    /**
+     * Unmap the file and forget the table of contents
+     */
+    void close ();
+    /**
+     * Rewrite the file with the images in use and the most recent others within CACHE_SIZE
+     */
+    void compact ();
+    /**
+     * Write a table of contents at the end of a file, and then the header pointing to it
+     * @param F The file, open for writing
+     * @param E The table of contents
+     * @param n Number of entries
+     * @param seq Sequence number of the save
+     * @return 0 on success, 1 on error
+     */
+    int finish (FILE *F, const Entry *E, int n, uint32_t seq);
+    /**
+     * Use a new mapping of the file and its table of contents, keeping the marks of the entries in use
+     * @param E The table of contents, taken over
+     * @param n Number of entries
+     * @param M The mapping, with a reference that is taken over, or nullptr to close the file
+     * @param seq Sequence number of the last save
+     */
+    void replace (Entry *E, int n, Wavemap *M, uint32_t seq);
+
+    char      _name [1024]; // path of the file
+    Wavemap  *_map;   // the mapped file, nullptr if not open
+    Entry    *_toc;   // table of contents
+    int       _ntoc;  // number of entries
+    uint32_t  _seq;   // last save () sequence number
+    P_mutex   _mutex; // protects the mapping and table of contents
+};
+
+
+#endif
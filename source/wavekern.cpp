@@ -0,0 +1,206 @@
+// ----------------------------------------------------------------------------
+//
+//  This program is free software; you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation; either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  This program is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+// ----------------------------------------------------------------------------
+
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+#include "wavekern.h"
+
+
+static const float PH_SCALE = 1.0f / PH_ONE;
+
+
+#if defined(__AVX2__)
+
+// Gather p [j] and p [j + 1] for 8 positions.
+static inline void gather (const float *p, __m256i j, __m256 *x, __m256 *y)
+{
+    *x = _mm256_i32gather_ps (p, j, 4);
+    *y = _mm256_i32gather_ps (p + 1, j, 4);
+}
+
+// For 16 bit tables both samples are fetched as one 32 bit word, p [j] in the
+// low and p [j + 1] in the high half (little endian, see global.h).
+static inline void gather (const int16_t *p, __m256i j, __m256 *x, __m256 *y)
+{
+    __m256i v;
+
+    v  = _mm256_i32gather_epi32 ((const int *) p, j, 2);
+    *x = _mm256_cvtepi32_ps (_mm256_srai_epi32 (_mm256_slli_epi32 (v, 16), 16));
+    *y = _mm256_cvtepi32_ps (_mm256_srai_epi32 (v, 16));
+}
+
+#endif
+
+
+template <typename T>
+static inline void kernel (const T *p, int32_t a, int32_t d, float *q, int n, float g, float dg)
+{
+    int     i;
+    int32_t j;
+    float   f, x;
+
+#if defined(__AVX2__)
+
+    // Two vectors of 8 per iteration, the table reads are hardware gathers.
+    __m256i  va, vd, vm;
+    __m256   vg, vdg, vs;
+
+    va  = _mm256_setr_epi32 (a, a + d, a + 2 * d, a + 3 * d, a + 4 * d, a + 5 * d, a + 6 * d, a + 7 * d);
+    vd  = _mm256_set1_epi32 (8 * d);
+    vm  = _mm256_set1_epi32 (PH_MASK);
+    vg  = _mm256_setr_ps (g, g - dg, g - 2 * dg, g - 3 * dg, g - 4 * dg, g - 5 * dg, g - 6 * dg, g - 7 * dg);
+    vdg = _mm256_set1_ps (8 * dg);
+    vs  = _mm256_set1_ps (PH_SCALE);
+    for (i = 0; i + 16 <= n; i += 16)
+    {
+        __m256i  j0, j1;
+        __m256   f0, f1, x0, x1, y0, y1;
+
+        j0 = _mm256_srai_epi32 (va, PH_BITS);
+        f0 = _mm256_mul_ps (_mm256_cvtepi32_ps (_mm256_and_si256 (va, vm)), vs);
+        va = _mm256_add_epi32 (va, vd);
+        j1 = _mm256_srai_epi32 (va, PH_BITS);
+        f1 = _mm256_mul_ps (_mm256_cvtepi32_ps (_mm256_and_si256 (va, vm)), vs);
+        va = _mm256_add_epi32 (va, vd);
+        gather (p, j0, &x0, &y0);
+        gather (p, j1, &x1, &y1);
+        x0 = _mm256_add_ps (x0, _mm256_mul_ps (f0, _mm256_sub_ps (y0, x0)));
+        x1 = _mm256_add_ps (x1, _mm256_mul_ps (f1, _mm256_sub_ps (y1, x1)));
+        _mm256_storeu_ps (q + i, _mm256_add_ps (_mm256_loadu_ps (q + i), _mm256_mul_ps (vg, x0)));
+        vg = _mm256_sub_ps (vg, vdg);
+        _mm256_storeu_ps (q + i + 8, _mm256_add_ps (_mm256_loadu_ps (q + i + 8), _mm256_mul_ps (vg, x1)));
+        vg = _mm256_sub_ps (vg, vdg);
+    }
+    a += i * d;
+    g -= i * dg;
+
+#elif defined(__SSE2__)
+
+    // Two vectors of 4 per iteration. SSE2 has no gather, the table reads are
+    // scalar loads from the vector computed indices, but the phase update, the
+    // interpolation and the output are branch free and vectorized.
+    __m128i  va, vd, vm;
+    __m128   vg, vdg, vs;
+    int32_t  J [8];
+
+    va  = _mm_setr_epi32 (a, a + d, a + 2 * d, a + 3 * d);
+    vd  = _mm_set1_epi32 (4 * d);
+    vm  = _mm_set1_epi32 (PH_MASK);
+    vg  = _mm_setr_ps (g, g - dg, g - 2 * dg, g - 3 * dg);
+    vdg = _mm_set1_ps (4 * dg);
+    vs  = _mm_set1_ps (PH_SCALE);
+    for (i = 0; i + 8 <= n; i += 8)
+    {
+        __m128   f0, f1, x0, x1, y0, y1;
+
+        _mm_storeu_si128 ((__m128i *) J, _mm_srai_epi32 (va, PH_BITS));
+        f0 = _mm_mul_ps (_mm_cvtepi32_ps (_mm_and_si128 (va, vm)), vs);
+        va = _mm_add_epi32 (va, vd);
+        _mm_storeu_si128 ((__m128i *)(J + 4), _mm_srai_epi32 (va, PH_BITS));
+        f1 = _mm_mul_ps (_mm_cvtepi32_ps (_mm_and_si128 (va, vm)), vs);
+        va = _mm_add_epi32 (va, vd);
+        x0 = _mm_setr_ps (p [J [0]], p [J [1]], p [J [2]], p [J [3]]);
+        y0 = _mm_setr_ps (p [J [0] + 1], p [J [1] + 1], p [J [2] + 1], p [J [3] + 1]);
+        x1 = _mm_setr_ps (p [J [4]], p [J [5]], p [J [6]], p [J [7]]);
+        y1 = _mm_setr_ps (p [J [4] + 1], p [J [5] + 1], p [J [6] + 1], p [J [7] + 1]);
+        x0 = _mm_add_ps (x0, _mm_mul_ps (f0, _mm_sub_ps (y0, x0)));
+        x1 = _mm_add_ps (x1, _mm_mul_ps (f1, _mm_sub_ps (y1, x1)));
+        _mm_storeu_ps (q + i, _mm_add_ps (_mm_loadu_ps (q + i), _mm_mul_ps (vg, x0)));
+        vg = _mm_sub_ps (vg, vdg);
+        _mm_storeu_ps (q + i + 4, _mm_add_ps (_mm_loadu_ps (q + i + 4), _mm_mul_ps (vg, x1)));
+        vg = _mm_sub_ps (vg, vdg);
+    }
+    a += i * d;
+    g -= i * dg;
+
+#elif defined(__ARM_NEON)
+
+    // Two vectors of 4 per iteration, same structure as the SSE2 version.
+    int32x4_t    va, vd, vm;
+    float32x4_t  vg, vdg;
+    int32_t      J [8];
+    const int32_t A [4] = { a, a + d, a + 2 * d, a + 3 * d };
+    const float   G [4] = { g, g - dg, g - 2 * dg, g - 3 * dg };
+
+    va  = vld1q_s32 (A);
+    vd  = vdupq_n_s32 (4 * d);
+    vm  = vdupq_n_s32 (PH_MASK);
+    vg  = vld1q_f32 (G);
+    vdg = vdupq_n_f32 (4 * dg);
+    for (i = 0; i + 8 <= n; i += 8)
+    {
+        float32x4_t  f0, f1, x0, x1, y0, y1;
+
+        vst1q_s32 (J, vshrq_n_s32 (va, PH_BITS));
+        f0 = vmulq_n_f32 (vcvtq_f32_s32 (vandq_s32 (va, vm)), PH_SCALE);
+        va = vaddq_s32 (va, vd);
+        vst1q_s32 (J + 4, vshrq_n_s32 (va, PH_BITS));
+        f1 = vmulq_n_f32 (vcvtq_f32_s32 (vandq_s32 (va, vm)), PH_SCALE);
+        va = vaddq_s32 (va, vd);
+        const float X0 [4] = { (float) p [J [0]], (float) p [J [1]], (float) p [J [2]], (float) p [J [3]] };
+        const float Y0 [4] = { (float) p [J [0] + 1], (float) p [J [1] + 1], (float) p [J [2] + 1], (float) p [J [3] + 1] };
+        const float X1 [4] = { (float) p [J [4]], (float) p [J [5]], (float) p [J [6]], (float) p [J [7]] };
+        const float Y1 [4] = { (float) p [J [4] + 1], (float) p [J [5] + 1], (float) p [J [6] + 1], (float) p [J [7] + 1] };
+        x0 = vld1q_f32 (X0);
+        y0 = vld1q_f32 (Y0);
+        x1 = vld1q_f32 (X1);
+        y1 = vld1q_f32 (Y1);
+        x0 = vmlaq_f32 (x0, f0, vsubq_f32 (y0, x0));
+        x1 = vmlaq_f32 (x1, f1, vsubq_f32 (y1, x1));
+        vst1q_f32 (q + i, vmlaq_f32 (vld1q_f32 (q + i), vg, x0));
+        vg = vsubq_f32 (vg, vdg);
+        vst1q_f32 (q + i + 4, vmlaq_f32 (vld1q_f32 (q + i + 4), vg, x1));
+        vg = vsubq_f32 (vg, vdg);
+    }
+    a += i * d;
+    g -= i * dg;
+
+#else
+
+    i = 0;
+
+#endif
+
+    // Scalar remainder, and the complete loop on other targets.
+    for (; i < n; i++)
+    {
+        j = a >> PH_BITS;
+        f = (a & PH_MASK) * PH_SCALE;
+        x = p [j];
+        q [i] += g * (x + f * (p [j + 1] - x));
+        a += d;
+        g -= dg;
+    }
+}
+
+
+void wavekern (const float *p, int32_t a, int32_t d, float *q, int n, float g, float dg)
+{
+    kernel (p, a, d, q, n, g, dg);
+}
+
+
+void wavekern (const int16_t *p, int32_t a, int32_t d, float *q, int n, float g, float dg)
+{
+    kernel (p, a, d, q, n, g, dg);
+}
@@ -0,0 +1,78 @@
+// ----------------------------------------------------------------------------
+//
+//  This program is free software; you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation; either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  This program is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+// ----------------------------------------------------------------------------
+
+
+#ifndef AEOLUS_WAVEKERN_H
+#define AEOLUS_WAVEKERN_H
+
+
+#include <cstdint>
+
+
+/**
+ * Fixed point format of the wavetable read position used by the playback kernels.
+ * A position is held as a signed 32-bit integer with PH_BITS fractional bits, relative to
+ * the table pointer handed to the kernel. 20 fractional bits leave room for an advance of
+ * up to 2047 table samples per call, which is far more than one PERIOD at the maximum
+ * sample step of 3, while keeping the interpolation fraction accurate to about 1e-6.
+ */
+#define PH_BITS 20
+#define PH_ONE  (1 << PH_BITS)
+#define PH_MASK (PH_ONE - 1)
+
+
+#ifndef WAVE16 // Store the wavetables as 16-bit integers with a per-pipe scale factor, to halve their size
+# define WAVE16 0
+#endif
+
+#if WAVE16
+typedef int16_t  wave_t; // wavetable sample, multiplied by Pipewave::_scale on playback
+#else
+typedef float    wave_t; // wavetable sample
+#endif
+
+
+/**
+ * Interpolating wavetable read, the inner loop of Pipewave::play.<br /><br />
+ * For i = 0 .. n-1, with a_i = a + i * d, j = a_i >> PH_BITS and f = (a_i & PH_MASK) / PH_ONE:<br />
+ * q [i] += (g - i * dg) * (p [j] + f * (p [j + 1] - p [j]))<br /><br />
+ * The caller guarantees that all p [j] and p [j + 1] are readable, the kernel does no wrapping.
+ * Depending on the target this is compiled to an AVX2 (16 samples per iteration, hardware
+ * gather), SSE2 or NEON (8 samples per iteration) or plain scalar loop. All variants compute the
+ * same values up to float rounding of the gain ramp.<br /><br />
+ * Compared to the former per-sample float phase of Pipewave::play, the quantisation of the
+ * position and of the step to 2^-20 table samples moves the reads of a call of 64 samples by
+ * less than 4e-5 table samples. The output differs by less than 4e-5 * max |p [j + 1] - p [j]|
+ * per sample, that is more than 100 dB below the signal for any realistic wavetable, and the
+ * pitch by less than 0.001 cent.
+ * @param p Wavetable read pointer, position 0
+ * @param a Fixed point position of the first output sample relative to p (may be slightly negative)
+ * @param d Fixed point advance per output sample, must be positive
+ * @param q Output buffer, the interpolated samples are added to it
+ * @param n Number of output samples
+ * @param g Gain applied to the first sample
+ * @param dg Gain decrement per sample
+ */
+void wavekern (const float *p, int32_t a, int32_t d, float *q, int n, float g, float dg);
+/**
+ * Same as above for 16 bit wavetables, see WAVE16. The samples are converted to float
+ * in the kernel, the scale factor of the table is expected to be included in g and dg.
+ */
+void wavekern (const int16_t *p, int32_t a, int32_t d, float *q, int n, float g, float dg);
+
+
+#endif
@@ -0,0 +1,228 @@
+// ----------------------------------------------------------------------------
+//
+//  This program is free software; you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation; either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  This program is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+// ----------------------------------------------------------------------------
+
+
+#include <cstring>
+#include "wavepack.h"
+
+
+// Bit stream: a block of up to 64 residuals starts with its Rice parameter k in 5 bits. A
+// residual r is zigzag mapped to u, and coded as q = u >> k in unary (q ones and a zero)
+// followed by the low k bits of u, or, if q >= QMAX, as QMAX ones followed by u in 32 bits.
+// Bits are stored from the least significant bit of each byte.
+
+#define BLOCK 64
+#define QMAX  24
+
+
+class Bitwriter
+{
+public:
+
+    Bitwriter (uint8_t *p) : _p (p), _b (p), _acc (0), _nb (0) {}
+
+    void put (uint32_t v, int n)
+    {
+        _acc |= (uint64_t) v << _nb;
+        _nb += n;
+        while (_nb >= 8)
+        {
+            *_p++ = (uint8_t) _acc;
+            _acc >>= 8;
+            _nb -= 8;
+        }
+    }
+
+    size_t flush ()
+    {
+        if (_nb) *_p++ = (uint8_t) _acc;
+        _acc = 0;
+        _nb = 0;
+        return _p - _b;
+    }
+
+private:
+
+    uint8_t   *_p;
+    uint8_t   *_b;
+    uint64_t   _acc;
+    int        _nb;
+};
+
+
+class Bitreader
+{
+public:
+
+    Bitreader (const uint8_t *p, size_t size) : _p (p), _b (p), _e (p + size), _z (0), _acc (0), _nb (0) {}
+
+    // At least 56 bits available after this.
+    void fill ()
+    {
+        uint64_t  v;
+
+        if (_e - _p >= 8)
+        {
+            memcpy (&v, _p, 8);
+            _acc |= v << _nb;
+            _p += (63 - _nb) >> 3;
+            _nb |= 56;
+        }
+        else
+        {
+            // Zeros past the end, caught by over ().
+            while (_nb <= 56)
+            {
+                if (_p < _e) _acc |= (uint64_t) *_p++ << _nb;
+                else _z++;
+                _nb += 8;
+            }
+        }
+    }
+
+    uint32_t get (int n)
+    {
+        uint32_t v = (uint32_t)(_acc & ((1ull << n) - 1));
+        _acc >>= n;
+        _nb -= n;
+        return v;
+    }
+
+    // Number of leading ones, at most QMAX, which are consumed.
+    int ones ()
+    {
+        int q = __builtin_ctzll (~_acc | (1ull << QMAX));
+        _acc >>= q;
+        _nb -= q;
+        return q;
+    }
+
+    bool over () const
+    {
+        return 8 * (int64_t)(_p - _b + _z) - _nb > 8 * (int64_t)(_e - _b);
+    }
+
+private:
+
+    const uint8_t  *_p;
+    const uint8_t  *_b;
+    const uint8_t  *_e;
+    size_t          _z;     // zero bytes read past the end
+    uint64_t        _acc;
+    int             _nb;
+};
+
+
+size_t wavepack_max (int n)
+{
+    return (size_t) n * (QMAX + 32 + 1) / 8 + (n / BLOCK + 1) + 16;
+}
+
+
+size_t wavepack (const int32_t *x, int n, uint8_t *p)
+{
+    Bitwriter  B (p);
+    int        i, j, k, m;
+    int32_t    x1, x2, r;
+    uint32_t   u [BLOCK], q;
+    uint64_t   s;
+
+    x1 = x2 = 0;
+    for (i = 0; i < n; i += BLOCK)
+    {
+        m = (n - i < BLOCK) ? n - i : BLOCK;
+        s = 0;
+        for (j = 0; j < m; j++)
+        {
+            r = x [i + j] - (2 * x1 - x2);
+            x2 = x1;
+            x1 = x [i + j];
+            u [j] = ((uint32_t) r << 1) ^ (uint32_t)(r >> 31);
+            s += u [j];
+        }
+        // The parameter that minimizes the size for a geometric distribution of this mean.
+        for (k = 0; (k < 30) && ((uint64_t) m << (k + 1) < s); k++);
+        B.put (k, 5);
+        for (j = 0; j < m; j++)
+        {
+            q = u [j] >> k;
+            if (q < QMAX)
+            {
+                B.put ((1u << q) - 1, q + 1);
+                if (k) B.put (u [j] & ((1u << k) - 1), k);
+            }
+            else
+            {
+                B.put ((1u << QMAX) - 1, QMAX);
+                B.put (u [j], 32);
+            }
+        }
+    }
+    return B.flush ();
+}
+
+
+template <class F> static int unpack (const uint8_t *p, size_t size, int n, F out)
+{
+    Bitreader  B (p, size);
+    int        i, j, k, m, q;
+    int32_t    x, x1, x2;
+    uint32_t   u;
+
+    x1 = x2 = 0;
+    for (i = 0; i < n; i += BLOCK)
+    {
+        m = (n - i < BLOCK) ? n - i : BLOCK;
+        B.fill ();
+        k = B.get (5);
+        if (k > 30) return 1;
+        for (j = 0; j < m; j++)
+        {
+            B.fill ();
+            q = B.ones ();
+            if (q < QMAX)
+            {
+                B.get (1);
+                u = ((uint32_t) q << k) | (k ? B.get (k) : 0);
+            }
+            else u = B.get (32);
+            x = (int32_t)((uint32_t)(2 * x1 - x2) + ((u >> 1) ^ (0u - (u & 1))));
+            x2 = x1;
+            x1 = x;
+            out (i + j, x);
+        }
+        if (B.over ()) return 1;
+    }
+    return 0;
+}
+
+
+int waveunpack (const uint8_t *p, size_t size, float *w, int n, float g)
+{
+    return unpack (p, size, n, [w, g] (int i, int32_t x) { w [i] = g * x; });
+}
+
+
+int waveunpack (const uint8_t *p, size_t size, int16_t *w, int n, int s)
+{
+    if (s <= 0) return unpack (p, size, n, [w] (int i, int32_t x) { w [i] = (int16_t) x; });
+    return unpack (p, size, n, [w, s] (int i, int32_t x)
+    {
+        x = (x + (1 << (s - 1))) >> s;
+        w [i] = (int16_t)((x > 32767) ? 32767 : x);
+    });
+}
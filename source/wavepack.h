@@ -0,0 +1,83 @@
+// ----------------------------------------------------------------------------
+//
+//  This program is free software; you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation; either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  This program is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+// ----------------------------------------------------------------------------
+
+
+#ifndef AEOLUS_WAVEPACK_H
+#define AEOLUS_WAVEPACK_H
+
+
+#include <cstddef>
+#include <cstdint>
+
+
+#ifndef WAVE_PACK // Save the wavetables compressed, with the samples quantized to this many bits (8 to 24), 0 to save them as they are
+# define WAVE_PACK 0
+#endif
+#if WAVE_PACK && ((WAVE_PACK < 8) || (WAVE_PACK > 24))
+# error "WAVE_PACK must be 0 or 8 to 24"
+#endif
+
+
+/**
+ * Compressed wavetable samples, see Rankwave::image.<br /><br />
+ * The samples are quantized to integers of up to 24 bits. Each one is predicted from the
+ * two before by linear extrapolation, which leaves small residuals for the smooth waveforms
+ * of the pipes, and the residuals are Rice coded in blocks of 64, with the parameter chosen
+ * per block. This is lossless for 16 bit tables (WAVE16) at 16 bits, and near-lossless for
+ * float tables at 24 bits, where the quantization error is about 135 dB below the peak.
+ * Fewer bits give smaller files at a lower signal to noise ratio.<br />
+ * Decoding runs at several hundred MB of samples per second and thread, and writes the
+ * samples in the playback format directly.
+ */
+
+/**
+ * Upper bound of the size of the compressed samples
+ * @param n Number of samples
+ * @return The size in bytes
+ */
+size_t wavepack_max (int n);
+/**
+ * Compress quantized samples
+ * @param x The samples, |x [i]| < 2^23
+ * @param n Number of samples
+ * @param p Output, at least wavepack_max (n) bytes
+ * @return The size of the compressed samples in bytes
+ */
+size_t wavepack (const int32_t *x, int n, uint8_t *p);
+/**
+ * Decompress samples into a float wavetable
+ * @param p The compressed samples
+ * @param size Their size in bytes
+ * @param w Output samples
+ * @param n Number of samples
+ * @param g Quantization step, the samples are g * x [i]
+ * @return 0 on success, 1 if the data is corrupt
+ */
+int waveunpack (const uint8_t *p, size_t size, float *w, int n, float g);
+/**
+ * Decompress samples into a 16 bit wavetable
+ * @param p The compressed samples
+ * @param size Their size in bytes
+ * @param w Output samples
+ * @param n Number of samples
+ * @param s Right shift to fit samples of more than 16 bits, the samples are x [i] / 2^s rounded
+ * @return 0 on success, 1 if the data is corrupt
+ */
+int waveunpack (const uint8_t *p, size_t size, int16_t *w, int n, int s);
+
+
+#endif
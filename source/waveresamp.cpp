@@ -0,0 +1,212 @@
+// ----------------------------------------------------------------------------
+//
+//  This program is free software; you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation; either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  This program is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+// ----------------------------------------------------------------------------
+
+
+#include <cmath>
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+#include "waveresamp.h"
+
+
+#define BETA  8.0    // Kaiser window parameter, about 80 dB stop band attenuation
+#define TWID  3.0    // half length of the filter times the width of the transition band
+
+
+// Modified Bessel function of order 0, by its power series.
+static double bessel_i0 (double x)
+{
+    int     k;
+    double  s, t;
+
+    s = t = 1.0;
+    for (k = 1; k < 40; k++)
+    {
+        t *= (0.5 * x / k) * (0.5 * x / k);
+        s += t;
+        if (t < 1e-12 * s) break;
+    }
+    return s;
+}
+
+
+// s0 = x . c0 and s1 = x . c1 over n samples, n a multiple of 8.
+
+#if defined(__AVX2__)
+
+static inline float hsum (__m256 a)
+{
+    __m128 s;
+
+    s = _mm_add_ps (_mm256_castps256_ps128 (a), _mm256_extractf128_ps (a, 1));
+    s = _mm_add_ps (s, _mm_movehl_ps (s, s));
+    s = _mm_add_ss (s, _mm_shuffle_ps (s, s, 1));
+    return _mm_cvtss_f32 (s);
+}
+
+static inline void dot2 (const float *x, const float *c0, const float *c1, int n, float *s0, float *s1)
+{
+    __m256  a0, a1, v;
+
+    a0 = _mm256_setzero_ps ();
+    a1 = _mm256_setzero_ps ();
+    for (int k = 0; k < n; k += 8)
+    {
+        v  = _mm256_loadu_ps (x + k);
+        a0 = _mm256_add_ps (a0, _mm256_mul_ps (v, _mm256_loadu_ps (c0 + k)));
+        a1 = _mm256_add_ps (a1, _mm256_mul_ps (v, _mm256_loadu_ps (c1 + k)));
+    }
+    *s0 = hsum (a0);
+    *s1 = hsum (a1);
+}
+
+#elif defined(__SSE2__)
+
+static inline float hsum (__m128 s)
+{
+    s = _mm_add_ps (s, _mm_movehl_ps (s, s));
+    s = _mm_add_ss (s, _mm_shuffle_ps (s, s, 1));
+    return _mm_cvtss_f32 (s);
+}
+
+static inline void dot2 (const float *x, const float *c0, const float *c1, int n, float *s0, float *s1)
+{
+    __m128  a0, a1, v;
+
+    a0 = _mm_setzero_ps ();
+    a1 = _mm_setzero_ps ();
+    for (int k = 0; k < n; k += 4)
+    {
+        v  = _mm_loadu_ps (x + k);
+        a0 = _mm_add_ps (a0, _mm_mul_ps (v, _mm_loadu_ps (c0 + k)));
+        a1 = _mm_add_ps (a1, _mm_mul_ps (v, _mm_loadu_ps (c1 + k)));
+    }
+    *s0 = hsum (a0);
+    *s1 = hsum (a1);
+}
+
+#elif defined(__ARM_NEON)
+
+static inline float hsum (float32x4_t a)
+{
+    float32x2_t s;
+
+    s = vadd_f32 (vget_low_f32 (a), vget_high_f32 (a));
+    s = vpadd_f32 (s, s);
+    return vget_lane_f32 (s, 0);
+}
+
+static inline void dot2 (const float *x, const float *c0, const float *c1, int n, float *s0, float *s1)
+{
+    float32x4_t  a0, a1, v;
+
+    a0 = vdupq_n_f32 (0.0f);
+    a1 = vdupq_n_f32 (0.0f);
+    for (int k = 0; k < n; k += 4)
+    {
+        v  = vld1q_f32 (x + k);
+        a0 = vmlaq_f32 (a0, v, vld1q_f32 (c0 + k));
+        a1 = vmlaq_f32 (a1, v, vld1q_f32 (c1 + k));
+    }
+    *s0 = hsum (a0);
+    *s1 = hsum (a1);
+}
+
+#else
+
+static inline void dot2 (const float *x, const float *c0, const float *c1, int n, float *s0, float *s1)
+{
+    float  a0, a1;
+
+    a0 = a1 = 0.0f;
+    for (int k = 0; k < n; k++)
+    {
+        a0 += x [k] * c0 [k];
+        a1 += x [k] * c1 [k];
+    }
+    *s0 = a0;
+    *s1 = a1;
+}
+
+#endif
+
+
+Waveresamp::Waveresamp (float fp, float fs) : _fp (fp), _fs (fs)
+{
+    int     i, k;
+    double  d, s, u, v, w, fc;
+    float  *c;
+
+    // The cutoff in the middle of the transition band, and the half length in input
+    // samples for its width.
+    fc = 0.5 * (fp + fs);
+    _nhalf = (int) ceil (TWID / (fs - fp));
+    _ntap = (2 * _nhalf + 7) & ~7;
+    _coef = new float [(NPHASE + 1) * _ntap];
+    w = 1.0 / bessel_i0 (BETA);
+    for (i = 0; i <= NPHASE; i++)
+    {
+        // Tap k of phase i is applied to the input sample at floor (t) - _nhalf + 1 + k,
+        // for a position t with a fractional part of i / NPHASE.
+        c = _coef + i * _ntap;
+        s = 0.0;
+        for (k = 0; k < _ntap; k++)
+        {
+            d = k - _nhalf + 1 - (double) i / NPHASE;
+            u = d / _nhalf;
+            if (fabs (u) >= 1.0) c [k] = 0.0f;
+            else
+            {
+                v = 2 * M_PI * fc * d;
+                v = (fabs (v) < 1e-9) ? 2 * fc : sin (v) / (M_PI * d);
+                c [k] = (float)(v * w * bessel_i0 (BETA * sqrt (1.0 - u * u)));
+            }
+            s += c [k];
+        }
+        // Unity gain at DC for every phase.
+        for (k = 0; k < _ntap; k++) c [k] = (float)(c [k] / s);
+    }
+}
+
+
+Waveresamp::~Waveresamp ()
+{
+    delete[] _coef;
+}
+
+
+void Waveresamp::run (const float *x, double t, double dt, float *y, int n) const
+{
+    int     i, j, p;
+    float   a, s0, s1;
+    double  u, f;
+
+    for (j = 0; j < n; j++)
+    {
+        u = t + j * dt;
+        i = (int) floor (u);
+        f = (u - i) * NPHASE;
+        p = (int) f;
+        a = (float)(f - p);
+        dot2 (x + i - _nhalf + 1, _coef + p * _ntap, _coef + (p + 1) * _ntap, _ntap, &s0, &s1);
+        y [j] = s0 + a * (s1 - s0);
+    }
+}
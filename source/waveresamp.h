@@ -0,0 +1,86 @@
+// ----------------------------------------------------------------------------
+//
+//  This program is free software; you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation; either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  This program is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+// ----------------------------------------------------------------------------
+
+
+#ifndef AEOLUS_WAVERESAMP_H
+#define AEOLUS_WAVERESAMP_H
+
+
+/**
+ * Polyphase resampler for the wavetables of a rank loaded at another sample rate, see
+ * Rankwave::resample.<br /><br />
+ * The filter is a Kaiser windowed sinc, flat up to the upper edge of the band to be kept and more
+ * than 80 dB down from the lower edge of the band that would alias, with a length inversely
+ * proportional to the distance between the two. The harmonics of the pipes are all below 0.45 of
+ * the sampling frequency, far below the table rate of the oversampled loops, where the transition
+ * band can be wide and the filter short. The filter is tabulated for NPHASE fractional positions,
+ * and the coefficients of a position in between are interpolated linearly from the two nearest
+ * ones, so that any ratio can be used, including the irrational ones that fit a loop into a new
+ * number of samples. The error in the pass band is 75 to 100 dB below the signal. The dot
+ * products are vectorized for AVX2, SSE2 and NEON, as in wavekern.
+ */
+class Waveresamp
+{
+public:
+    /**
+     * Constructor, computes the filter table
+     * @param fp Upper edge of the pass band, relative to the input sample rate
+     * @param fs Lower edge of the stop band, relative to the input sample rate, at most 0.5
+     */
+    Waveresamp (float fp, float fs);
+    ~Waveresamp ();
+
+    /**
+     * Is this the filter for the given band edges
+     * @param fp Upper edge of the pass band
+     * @param fs Lower edge of the stop band
+     * @return true if it is
+     */
+    [[nodiscard]] bool same (float fp, float fs) const { return (fp == _fp) && (fs == _fs); }
+    /**
+     * Number of input samples read on either side of a position. The caller provides them,
+     * run () does no bounds checks or wrapping.
+     * @return The number of samples
+     */
+    [[nodiscard]] int pad () const { return _ntap; }
+    /**
+     * Resample: y [j] is the band limited input at the position t + j * dt, in input samples
+     * relative to x
+     * @param x Input samples, readable from t - pad () to t + (n - 1) * dt + pad ()
+     * @param t Position of the first output sample
+     * @param dt Advance per output sample, the ratio of the input and output sample rates
+     * @param y Output samples
+     * @param n Number of output samples
+     */
+    void run (const float *x, double t, double dt, float *y, int n) const;
+
+    enum { NPHASE = 256 };
+
+private:
+
+    Waveresamp (const Waveresamp&);
+    Waveresamp& operator=(const Waveresamp&);
+
+    float   _fp;    // upper edge of the pass band
+    float   _fs;    // lower edge of the stop band
+    int     _nhalf; // half length of the filter in input samples
+    int     _ntap;  // taps per phase, 2 * _nhalf rounded up to a multiple of 8
+    float  *_coef;  // NPHASE + 1 phases of _ntap coefficients
+};
+
+
+#endif
@@ -0,0 +1,166 @@
+// ----------------------------------------------------------------------------
+//
+//  This program is free software; you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation; either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  This program is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+// ----------------------------------------------------------------------------
+
+
+#include <cmath>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "wavetab.h"
+
+
+P_mutex   Wavetab::_mutex;
+Wavetab  *Wavetab::_hash [NHASH] = { nullptr };
+
+
+Wavemap *Wavemap::open (const char *name)
+{
+    int          fd;
+    void         *p;
+    struct stat  s;
+
+    fd = ::open (name, O_RDONLY);
+    if (fd < 0) return nullptr;
+    p = MAP_FAILED;
+    if (! fstat (fd, &s) && (s.st_size > 0)) p = mmap (nullptr, s.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    // The mapping stays valid after the descriptor is closed.
+    close (fd);
+    if (p == MAP_FAILED) return nullptr;
+    return new Wavemap ((const char *) p, s.st_size);
+}
+
+
+void Wavemap::release ()
+{
+    if (_refc.fetch_sub (1, std::memory_order_acq_rel) == 1) delete this;
+}
+
+
+void Wavemap::prefetch (size_t offs, size_t size) const
+{
+    size_t  a;
+
+    if (offs >= _size) return;
+    if (size > _size - offs) size = _size - offs;
+    // madvise () wants a page aligned start, the mapping is.
+    a = offs & ~(size_t)(sysconf (_SC_PAGESIZE) - 1);
+    madvise ((void *)(_data + a), offs + size - a, MADV_WILLNEED);
+}
+
+
+Wavemap::~Wavemap ()
+{
+    munmap ((void *) _data, _size);
+}
+
+
+Wavetab::Wavetab (uint64_t key, int size) :
+    _l0 (0), _l1 (0), _k_s (0), _k_d (1), _k_r (0), _m_r (0), _d_r (0), _d_p (0), _scale (1.0f), _peak (0),
+    _key (key), _map (nullptr), _refc (1), _next (nullptr)
+{
+    _p0 = new wave_t [size];
+}
+
+
+Wavetab::Wavetab (uint64_t key, Wavemap *map, size_t offs) :
+    _l0 (0), _l1 (0), _k_s (0), _k_d (1), _k_r (0), _m_r (0), _d_r (0), _d_p (0), _scale (1.0f), _peak (0),
+    _key (key), _map (map), _refc (1), _next (nullptr)
+{
+    _map->acquire ();
+    _p0 = (wave_t *)(_map->data () + offs);
+}
+
+
+Wavetab::~Wavetab ()
+{
+    if (_map) _map->release ();
+    else delete[] _p0;
+}
+
+
+Wavetab *Wavetab::find (uint64_t key)
+{
+    Wavetab *T;
+
+    _mutex.lock ();
+    for (T = _hash [key % NHASH]; T && (T->_key != key); T = T->_next);
+    if (T) T->_refc++;
+    _mutex.unlock ();
+    return T;
+}
+
+
+Wavetab *Wavetab::insert (Wavetab *T)
+{
+    Wavetab *R;
+
+    _mutex.lock ();
+    for (R = _hash [T->_key % NHASH]; R && (R->_key != T->_key); R = R->_next);
+    if (R)
+    {
+        R->_refc++;
+        delete T;
+        T = R;
+    }
+    else
+    {
+        // One reference for the registry, one for the caller.
+        T->_refc++;
+        T->_next = _hash [T->_key % NHASH];
+        _hash [T->_key % NHASH] = T;
+    }
+    _mutex.unlock ();
+    return T;
+}
+
+
+void Wavetab::release ()
+{
+    Wavetab  **P;
+    bool     d;
+
+    _mutex.lock ();
+    // A registered table is removed when only the reference of the registry is left.
+    if (--_refc == 1)
+    {
+        for (P = _hash + _key % NHASH; *P && (*P != this); P = &(*P)->_next);
+        if (*P)
+        {
+            *P = _next;
+            _refc = 0;
+        }
+    }
+    d = (_refc == 0);
+    _mutex.unlock ();
+    if (d) delete this;
+}
+
+
+void Wavetab::setpeak ()
+{
+    int    i;
+    float  v;
+
+    _peak = 0.0f;
+    for (i = 0; i < _l1; i++)
+    {
+        v = fabsf ((float) _p0 [_l0 + i]);
+        if (v > _peak) _peak = v;
+    }
+    _peak *= _scale;
+}
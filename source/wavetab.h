@@ -0,0 +1,164 @@
+// ----------------------------------------------------------------------------
+//
+//  This program is free software; you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation; either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  This program is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+// ----------------------------------------------------------------------------
+
+
+#ifndef AEOLUS_WAVETAB_H
+#define AEOLUS_WAVETAB_H
+
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include "wavekern.h"
+#include "../../clthreads/include/clthreads.h"
+
+
+/**
+ * Read-only memory mapping of a wavetable file (.ae1 version 2), see Rankwave::load.
+ * The Wavetab instances loaded from it point into the mapping instead of holding a copy
+ * of the samples, so that these are paged in on demand and count as file cache. The
+ * mapping is reference counted, and unmapped with its last reference.
+ */
+class Wavemap
+{
+public:
+    /**
+     * Map a file
+     * @param name Path of the file
+     * @return The mapping with one reference for the caller, or nullptr on error
+     */
+    static Wavemap *open (const char *name);
+    /**
+     * Take a reference
+     */
+    void acquire () { _refc.fetch_add (1, std::memory_order_relaxed); }
+    /**
+     * Give back a reference, unmapping the file if it was the last one
+     */
+    void release ();
+    /**
+     * Start of the mapping, page aligned
+     * @return The first byte of the file
+     */
+    [[nodiscard]] const char *data () const { return _data; }
+    /**
+     * Size of the mapping
+     * @return The size of the file in bytes
+     */
+    [[nodiscard]] size_t size () const { return _size; }
+    /**
+     * Have the kernel read a part of the file in the background, so that it is in memory
+     * by the time it is used
+     * @param offs Offset of the part
+     * @param size Size of the part
+     */
+    void prefetch (size_t offs, size_t size) const;
+
+private:
+
+    Wavemap (const char *data, size_t size) : _data (data), _size (size), _refc (1) {}
+    ~Wavemap ();
+    Wavemap (const Wavemap&);
+    Wavemap& operator=(const Wavemap&);
+
+    const char        *_data; // mapped file
+    size_t             _size; // file size
+    std::atomic<int>   _refc; // reference count
+};
+
+
+/**
+ * Shared, read-only wavetable of a pipe.<br /><br />
+ * Pipes of different Rankwave instances that are generated from identical parameters
+ * (the same stop in several divisions, or repeated actions with MULTISTOP) use a single
+ * Wavetab. The tables are kept in a registry keyed by a hash of everything the generation
+ * depends on, see Pipewave::genkey, and are reference counted: find () and insert () return
+ * a reference that is given back with release (). The table is deleted with its last reference.<br />
+ * The registry is protected by a mutex. It is used by the threads creating and deleting ranks,
+ * never by the audio thread.
+ */
+class Wavetab
+{
+public:
+    /**
+     * Constructor, allocates the samples. The table is not registered yet.
+     * @param key Generation key
+     * @param size Number of samples
+     */
+    Wavetab (uint64_t key, int size);
+    /**
+     * Constructor for a table in a mapped wavetable file. The table is not registered yet.
+     * @param key Generation key
+     * @param map The mapping, a reference is taken
+     * @param offs Offset of the samples in the mapping
+     */
+    Wavetab (uint64_t key, Wavemap *map, size_t offs);
+
+    /**
+     * Look up a registered table
+     * @param key Generation key
+     * @return The table with a new reference, or nullptr if there is none
+     */
+    static Wavetab *find (uint64_t key);
+    /**
+     * Register a table. If a table with the same key was registered in the meantime,
+     * T is deleted and the registered one is returned instead.
+     * @param T The new table, its reference is handed to the registry
+     * @return The registered table, with one reference for the caller
+     */
+    static Wavetab *insert (Wavetab *T);
+    /**
+     * Give back a reference, deleting the table if it was the last one
+     */
+    void release ();
+    /**
+     * Compute _peak from the loop section. It is used by Voicetab::play to estimate
+     * audibility. The attack may be louder, but a pipe is never culled during its attack.
+     */
+    void setpeak ();
+
+    wave_t     *_p0;    // samples: attack, loop and the copy of the loop start, read-only if mapped
+    int32_t     _l0;    // attack length
+    int32_t     _l1;    // loop length
+    int16_t     _k_s;   // sample step
+    int16_t     _k_d;   // loop rate reduction
+    int16_t     _k_r;   // release length
+    float       _m_r;   // release multiplier
+    float       _d_r;   // release detune
+    float       _d_p;   // instability
+    float       _scale; // gain applied to the samples
+    float       _peak;  // peak level of the loop section
+
+private:
+
+    ~Wavetab ();
+    Wavetab (const Wavetab&);
+    Wavetab& operator=(const Wavetab&);
+
+    enum { NHASH = 256 };
+
+    uint64_t    _key;   // generation key
+    Wavemap    *_map;   // mapping holding the samples, nullptr if they are allocated
+    int         _refc;  // reference count
+    Wavetab    *_next;  // next table in the same hash chain
+
+    static P_mutex   _mutex;
+    static Wavetab  *_hash [NHASH];
+};
+
+
+#endif
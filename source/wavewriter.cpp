@@ -0,0 +1,162 @@
+// ----------------------------------------------------------------------------
+//
+//  This program is free software; you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation; either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  This program is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+// ----------------------------------------------------------------------------
+
+
+#include <cstring>
+#include <sched.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include "wavewriter.h"
+#include "rankwave.h"
+
+
+Wavewriter::Wavewriter (Wavebundle *B) :
+    _bundle (B),
+    _queue (nullptr),
+    _nqueue (0),
+    _mqueue (0),
+    _nwait (0),
+    _stop (false)
+{
+    _run = ! thr_start (SCHED_OTHER, 0, 0x10000);
+}
+
+
+Wavewriter::~Wavewriter ()
+{
+    if (_run)
+    {
+        _mutex.lock ();
+        _stop = true;
+        _nwait++;
+        _mutex.unlock ();
+        _wake.post ();
+        _done.wait ();
+    }
+    else flush ();
+    delete[] _queue;
+}
+
+
+void Wavewriter::save (Rankwave **W, int n, float fsamp)
+{
+    int                 i, j;
+    size_t              k;
+    char               *d, *f;
+    Wavebundle::Image  *Q;
+
+    for (i = 0; i < n; i++)
+    {
+        d = W [i]->image (fsamp, &k);
+        f = W [i]->oldfile ();
+        _mutex.lock ();
+        for (j = 0; (j < _nqueue) && (_queue [j].key != W [i]->rankkey ()); j++);
+        if (j < _nqueue)
+        {
+            delete[] _queue [j].data;
+            if (f) delete[] _queue [j].file;
+            else f = _queue [j].file;
+        }
+        else
+        {
+            if (_nqueue == _mqueue)
+            {
+                _mqueue = 2 * _mqueue + 16;
+                Q = new Wavebundle::Image [_mqueue];
+                if (_nqueue) memcpy (Q, _queue, _nqueue * sizeof (Wavebundle::Image));
+                delete[] _queue;
+                _queue = Q;
+            }
+            _nqueue++;
+        }
+        _queue [j].key = W [i]->rankkey ();
+        _queue [j].data = d;
+        _queue [j].size = k;
+        _queue [j].file = f;
+        _mutex.unlock ();
+    }
+    if (_run) _wake.post ();
+    else flush ();
+}
+
+
+void Wavewriter::wait ()
+{
+    if (! _run) return;
+    _mutex.lock ();
+    _nwait++;
+    _mutex.unlock ();
+    _wake.post ();
+    _done.wait ();
+}
+
+
+void Wavewriter::flush ()
+{
+    int                 i, n, e;
+    Wavebundle::Image  *Q;
+
+    while (true)
+    {
+        // The queue is taken as it is, save () starts a new one meanwhile.
+        _mutex.lock ();
+        Q = _queue;
+        n = _nqueue;
+        _queue = nullptr;
+        _nqueue = 0;
+        _mqueue = 0;
+        _mutex.unlock ();
+        e = n ? _bundle->save (Q, n) : 1;
+        for (i = 0; i < n; i++)
+        {
+            // The file of a rank is only deleted once its image is safely in the bundle.
+            if (! e && Q [i].file) unlink (Q [i].file);
+            delete[] Q [i].data;
+            delete[] Q [i].file;
+        }
+        delete[] Q;
+        if (! n) break;
+    }
+}
+
+
+void Wavewriter::thr_main ()
+{
+    int   k;
+    bool  stop;
+
+    // Idle I/O priority, see ioprio_set (2), and a low CPU priority, for this thread only.
+    // Writing the bundle must never hold up loading or generating ranks.
+#ifdef SYS_ioprio_set
+    syscall (SYS_ioprio_set, 1, 0, 3 << 13);
+#endif
+    setpriority (PRIO_PROCESS, 0, 10);
+    while (true)
+    {
+        _wake.wait ();
+        flush ();
+        _mutex.lock ();
+        k = _nwait;
+        _nwait = 0;
+        stop = _stop;
+        _mutex.unlock ();
+        // The destructor may return as soon as it is posted.
+        while (k--) _done.post ();
+        if (stop) break;
+    }
+}
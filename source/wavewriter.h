@@ -0,0 +1,91 @@
+// ----------------------------------------------------------------------------
+//
+//  This program is free software; you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation; either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  This program is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+// ----------------------------------------------------------------------------
+
+
+#ifndef AEOLUS_WAVEWRITER_H
+#define AEOLUS_WAVEWRITER_H
+
+
+#include "../../clthreads/include/clthreads.h"
+#include "wavebundle.h"
+
+
+class Rankwave;
+
+
+/**
+ * Writer thread for the wavetable bundle of the instrument.<br /><br />
+ * save () copies the wavetables of the ranks into their images (see Rankwave::image) in the
+ * calling thread, which is quick, and queues them. The writer thread then adds the queued
+ * images to the bundle, all of them in one Wavebundle::save, at an idle I/O priority and a
+ * low CPU priority, so that the slave thread can go on loading and generating ranks meanwhile.
+ * A rank saved again before it has been written only has its last image written.<br />
+ * The ae1 file a rank was loaded from, as written before there were bundles (see Rankwave::oldfile),
+ * is deleted once the save that holds its image has succeeded. Other files in the directory of the
+ * bundle are left alone: it is shared by all instruments.<br />
+ * If the thread can't be started, save () writes the images itself.
+ */
+class Wavewriter : public P_thread
+{
+public:
+    /**
+     * Constructor, starts the thread
+     * @param B The bundle to write to. Its file must only be changed by Wavebundle::use after wait ().
+     */
+    explicit Wavewriter (Wavebundle *B);
+    /**
+     * Destructor, writes what is queued and stops the thread
+     */
+    ~Wavewriter () override;
+
+    /**
+     * Queue the ranks to be written to the bundle
+     * @param W The ranks, complete
+     * @param n Number of ranks
+     * @param fsamp Sampling frequency
+     */
+    void save (Rankwave **W, int n, float fsamp);
+    /**
+     * Wait until the ranks queued so far have been written
+     */
+    void wait ();
+
+private:
+
+    Wavewriter (const Wavewriter&);
+    Wavewriter& operator=(const Wavewriter&);
+
+    void thr_main () override;
+    /**
+     * Write the queued images, until there are none left
+     */
+    void flush ();
+
+    Wavebundle         *_bundle;
+    Wavebundle::Image  *_queue;  // images to be written
+    int                 _nqueue; // number of images
+    int                 _mqueue; // allocated images
+    int                 _nwait;  // callers of wait () and the destructor waiting for _done
+    bool                _run;    // the thread has been started
+    volatile bool       _stop;   // the thread is to exit
+    P_mutex             _mutex;  // protects the queue and _nwait
+    P_sema              _wake;   // posted by save (), wait () and the destructor
+    P_sema              _done;   // posted for each waiting caller when the queue is empty
+};
+
+
+#endif